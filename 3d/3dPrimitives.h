@@ -1,105 +1,122 @@
 #pragma once
 #include "linalg.h"
-
-
-bool FacesCamera(Vec3d t1, Vec3d t2, Vec3d t3) {
-  // Calculate the normal of the triangle
-  Vec3d normal = Normal(t1,t2,t3);
-  double d = normal.dot(t1);
-  return d > 0;
-}
-
-class Triangle {
-public:
-	Vec2d p1, p2, p3;
-	double distFromCamera;
-	bool facesCamera;
-	uint16_t col;
-};
+#include "triangleArena.h"
 
 class Object {
 public:
-	Object(Vec3d const& centre) : _centre(centre) {}
+	Object(Vec3 const& centre) : _centre(centre) {}
 	virtual void update(uint32_t time) = 0;
-	virtual std::vector<Triangle> getTriangles(Vec3d const&) = 0;
-	Vec3d _centre{};
-	Vec3d _rotation{};
+	// project the visible faces seen from camera and append them to out
+	virtual void appendTriangles(Vec3 const& camera, TriangleArena &out) = 0;
+	Vec3 _centre{};
+	Vec3 _rotation{};
 
 protected:
-	Eigen::MatrixXd rotate(const Eigen::MatrixXd& vertices, const Vec3d& angles) {
+	static Mat3 rotationMatrix(const Vec3& angles) {
 	  // Create quaternions for each rotation
-	  Eigen::Quaterniond q_x(Eigen::AngleAxisd(angles[0] * M_PI/180.0, Eigen::Vector3d::UnitX()));
-	  Eigen::Quaterniond q_y(Eigen::AngleAxisd(angles[1] * M_PI/180.0, Eigen::Vector3d::UnitY()));
-	  Eigen::Quaterniond q_z(Eigen::AngleAxisd(angles[2] * M_PI/180.0, Eigen::Vector3d::UnitZ()));
-
-	  // Rotate the vertices
-	  return (q_z * q_y * q_x).toRotationMatrix() * vertices;
+	  Eigen::Quaternion<real_t> q_x(Eigen::AngleAxis<real_t>(angles[0] * DEG2RAD, Vec3::UnitX()));
+	  Eigen::Quaternion<real_t> q_y(Eigen::AngleAxis<real_t>(angles[1] * DEG2RAD, Vec3::UnitY()));
+	  Eigen::Quaternion<real_t> q_z(Eigen::AngleAxis<real_t>(angles[2] * DEG2RAD, Vec3::UnitZ()));
+	  return (q_z * q_y * q_x).toRotationMatrix();
 	}
 };
 
-class Cube : public Object {
+// Indexed triangle mesh: a vertex buffer, an index buffer (3 vertices per face, wound like the
+// faces of Cube) and optional per-face colours, usually constant arrays in flash (they are not
+// copied). The face normals are computed once by the constructor.
+//
+// appendTriangles() transforms and projects each vertex exactly once and rotates the normals
+// instead of recomputing them from the transformed vertices, so a frame costs one matrix
+// product per vertex and per face plus the lighting of the visible faces. Its per vertex
+// buffers are allocated by the constructor: a frame does not allocate.
+class Mesh : public Object {
 public:
 	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-	Cube(Vec3d const& centre) : Object(centre) {}
-	void update(uint32_t time){
-		double const speed = 0.3;
-		_rotation[0] = speed * 1 * time;
-		_rotation[1] = speed * 2 * time;
-		_rotation[2] = 30;
+	Mesh(Vec3 const& centre, const real_t (*vertices)[3], int nbVertices,
+			const uint16_t (*faces)[3], int nbFaces, const uint16_t *colors = nullptr,
+			uint16_t col = 0xffff) :
+			Object(centre), _vertices(vertices), _faces(faces), _nbFaces(nbFaces),
+			_colors(colors), _col(col), _normals(nbFaces), _view(nbVertices),
+			_plane(nbVertices) {
+		for (int f = 0; f < nbFaces; f++) {
+			_normals[f] = Normal(vertex(_faces[f][0]), vertex(_faces[f][1]), vertex(_faces[f][2]));
+		}
 	}
 
-	static double arrVert[8][3];
+	// static unless a subclass animates _rotation
+	void update(uint32_t) override {}
+
+	int nbVertices() const { return (int) _view.size(); }
+	int nbFaces() const { return _nbFaces; }
 
-	std::vector<Triangle> getTriangles(Vec3d const& camera)
+	void appendTriangles(Vec3 const& camera, TriangleArena &out) override
 	{
-		// Rotate + project the vertices onto the 2D plane
-		// Vec3d vecPfc[8];
-		Eigen::Matrix<double, 3, 8> vertices = Eigen::Matrix<double, 3, 8>::Map(arrVert[0]);
-		Eigen::Matrix<double, 3, 8> matPfc = rotate(vertices, _rotation).colwise() + (_centre - camera);
-
-		std::array<Vec2d, 8> projectedVertices;
-		for (int i = 0; i < 8; i++) {
-			projectedVertices[i] = {matPfc(0, i) / matPfc(2, i), matPfc(1, i) / matPfc(2, i)}; // focal plane 1 unit behind lens
+		const Mat3 rot = rotationMatrix(_rotation);
+		const Vec3 offset = _centre - camera;
+
+		// Rotate + project the vertices onto the 2D plane, once per vertex
+		for (int i = 0; i < nbVertices(); i++) {
+			_view[i] = rot * vertex(i) + offset;
+			_plane[i] = TriangleArena::toPlane(_view[i][0] / _view[i][2], _view[i][1] / _view[i][2]); // focal plane 1 unit behind lens
+		}
+
+		const Vec3 light{2, 2, 0};
+		for (int f = 0; f < _nbFaces; f++) {
+			const int i = _faces[f][0], j = _faces[f][1], k = _faces[f][2];
+			const Vec3 normal = rot * _normals[f];
+			if (normal.dot(_view[i]) <= 0) continue; // back face
+
+			// shine if we face the light
+			uint16_t col = (_colors != nullptr) ? _colors[f] : _col;
+			real_t facesLight = std::max(real_t(0), real_t(-normal.dot((light - _view[i]).normalized())));
+			col = lerpCol(col, 0xffff, static_cast<float>(facesLight/2));
+
+			// dark if we are far away
+			real_t dist = _view[k][2];
+			using std::sqrt;
+			real_t fade = clamp(sqrt(dist/20), real_t(0), real_t(2))/2;
+			col = lerpCol(col, 0, static_cast<float>(fade));
+
+			out.push(_plane[i], _plane[j], _plane[k], dist, col);
 		}
+	}
 
-		std::vector<Triangle> triangles;
-		triangles.reserve(12);
-
-		// Create the triangles that make up the cube
-		auto makeTri = [&](int i, int j, int k, uint16_t col) {
-			bool facesCamera = FacesCamera(matPfc.col(i), matPfc.col(j), matPfc.col(k));
-
-			if (facesCamera) {
-				// shine if we face the light
-				double facesLight = std::max(0.0, NormToPoint(matPfc.col(i), matPfc.col(j), matPfc.col(k), {2, 2, 0}));
-				col = lerpCol(col, 0xffff, facesLight/2);
-
-				// dark if we are far away
-				double dist = matPfc.col(k)[2];//ShortestDistance(matPfc.col(i), matPfc.col(j), matPfc.col(k));
-				double fade = clamp(sqrt(dist/20), 0.0, 2.0)/2;
-				col = lerpCol(col, 0, fade);
-
-				triangles.push_back({projectedVertices[i], projectedVertices[j], projectedVertices[k], dist, facesCamera, col});
-			}
-		};
-
-		makeTri(0, 1, 2, mapColor(0.2));
-		makeTri(2, 3, 0, mapColor(0.2));
-		makeTri(1, 5, 6, mapColor(0.3));
-		makeTri(6, 2, 1, mapColor(0.3));
-		makeTri(7, 6, 5, mapColor(0.4));
-		makeTri(5, 4, 7, mapColor(0.4));
-		makeTri(4, 0, 3, mapColor(0.5));
-		makeTri(3, 7, 4, mapColor(0.5));
-		makeTri(4, 5, 1, mapColor(0.6));
-		makeTri(1, 0, 4, mapColor(0.6));
-		makeTri(3, 2, 6, mapColor(0.7));
-		makeTri(6, 7, 3, mapColor(0.7));
-		return triangles;
+protected:
+	Eigen::Map<const Vec3> vertex(int i) const { return Eigen::Map<const Vec3>(_vertices[i]); }
+
+	const real_t (*_vertices)[3];
+	const uint16_t (*_faces)[3];
+	int _nbFaces;
+	const uint16_t *_colors;
+	uint16_t _col;
+	std::vector<Vec3> _normals;   // model space, per face
+	std::vector<Vec3> _view;      // camera space, per vertex
+	std::vector<Point16> _plane;  // focal plane (fixed point), per vertex
+};
+
+class Cube : public Mesh {
+public:
+	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+	Cube(Vec3 const& centre) : Mesh(centre, arrVert, 8, arrFaces, 12, _faceCol) {
+		for (int f = 0; f < 12; f++) {
+			_faceCol[f] = mapColor(arrShade[f]);
+		}
+	}
+	void update(uint32_t time) override {
+		_rotation[0] = periodicAngle(time, 30); // 0.3 deg per frame
+		_rotation[1] = periodicAngle(time, 60);
+		_rotation[2] = 30;
 	}
+
+	static const real_t arrVert[8][3];
+	static const uint16_t arrFaces[12][3];
+	static const float arrShade[12];
+
+private:
+	uint16_t _faceCol[12];
 };
 
-double Cube::arrVert[8][3] = {{-0.5, -0.5, -0.5},
+const real_t Cube::arrVert[8][3] = {{-0.5, -0.5, -0.5},
 							  { 0.5, -0.5, -0.5},
 							  { 0.5,  0.5, -0.5},
 							  {-0.5,  0.5, -0.5},
@@ -107,3 +124,12 @@ double Cube::arrVert[8][3] = {{-0.5, -0.5, -0.5},
 							  { 0.5, -0.5,  0.5},
 							  { 0.5,  0.5,  0.5},
 							  { -0.5, 0.5,  0.5}};
+
+const uint16_t Cube::arrFaces[12][3] = {{0, 1, 2}, {2, 3, 0},
+							  {1, 5, 6}, {6, 2, 1},
+							  {7, 6, 5}, {5, 4, 7},
+							  {4, 0, 3}, {3, 7, 4},
+							  {4, 5, 1}, {1, 0, 4},
+							  {3, 2, 6}, {6, 7, 3}};
+
+const float Cube::arrShade[12] = {0.2, 0.2, 0.3, 0.3, 0.4, 0.4, 0.5, 0.5, 0.6, 0.6, 0.7, 0.7};
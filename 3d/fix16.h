@@ -0,0 +1,181 @@
+#pragma once
+#include <stdint.h>
+#include <type_traits>
+#include <Eigen/Core>
+
+// Q16.16 fixed point number: 16 integer bits (range [-32768, 32768[) and 16 fractional bits
+// (resolution 1.5e-5). Multiplications use a 32x32->64 bit product (SMULL on the Cortex-M4)
+// and everything but the conversions from/to float stays in integer registers, with bit exact
+// results on any target.
+//
+// It is a drop-in scalar for Eigen (see the NumTraits specialisation below) and provides the
+// math functions the 3d pipeline uses (sqrt, sin, cos, floor, abs), found by argument dependent
+// lookup: call them unqualified after 'using std::sin;' etc. so that the same code also
+// compiles with float.
+class Fix16 {
+public:
+	static constexpr int FRAC_BITS = 16;
+	static constexpr int32_t ONE = 1 << FRAC_BITS;
+
+	constexpr Fix16() : _raw(0) {}
+
+	template<typename I, typename std::enable_if<std::is_integral<I>::value, int>::type = 0>
+	constexpr Fix16(I v) : _raw((int32_t) v * ONE) {}
+
+	constexpr Fix16(float v) : _raw((int32_t) (v * ONE + ((v >= 0) ? 0.5f : -0.5f))) {}
+
+	constexpr Fix16(double v) : _raw((int32_t) (v * ONE + ((v >= 0) ? 0.5 : -0.5))) {}
+
+	static constexpr Fix16 fromRaw(int32_t raw) {
+		return Fix16(raw, 0);
+	}
+
+	constexpr int32_t raw() const {
+		return _raw;
+	}
+
+	// rounds towards -infinity
+	explicit constexpr operator int() const {
+		return _raw >> FRAC_BITS;
+	}
+
+	explicit constexpr operator float() const {
+		return _raw * (1.0f / ONE);
+	}
+
+	explicit constexpr operator double() const {
+		return _raw * (1.0 / ONE);
+	}
+
+	constexpr Fix16 operator-() const {
+		return fromRaw(-_raw);
+	}
+
+	Fix16& operator+=(Fix16 b) {
+		_raw += b._raw;
+		return *this;
+	}
+
+	Fix16& operator-=(Fix16 b) {
+		_raw -= b._raw;
+		return *this;
+	}
+
+	Fix16& operator*=(Fix16 b) {
+		_raw = _saturate(((int64_t) _raw * b._raw) >> FRAC_BITS);
+		return *this;
+	}
+
+	Fix16& operator/=(Fix16 b) {
+		_raw = (b._raw != 0) ? _saturate((((int64_t) _raw) * ONE) / b._raw) :
+				((_raw >= 0) ? INT32_MAX : INT32_MIN);
+		return *this;
+	}
+
+	friend Fix16 operator+(Fix16 a, Fix16 b) { return a += b; }
+	friend Fix16 operator-(Fix16 a, Fix16 b) { return a -= b; }
+	friend Fix16 operator*(Fix16 a, Fix16 b) { return a *= b; }
+	friend Fix16 operator/(Fix16 a, Fix16 b) { return a /= b; }
+
+	friend constexpr bool operator==(Fix16 a, Fix16 b) { return a._raw == b._raw; }
+	friend constexpr bool operator!=(Fix16 a, Fix16 b) { return a._raw != b._raw; }
+	friend constexpr bool operator<(Fix16 a, Fix16 b) { return a._raw < b._raw; }
+	friend constexpr bool operator>(Fix16 a, Fix16 b) { return a._raw > b._raw; }
+	friend constexpr bool operator<=(Fix16 a, Fix16 b) { return a._raw <= b._raw; }
+	friend constexpr bool operator>=(Fix16 a, Fix16 b) { return a._raw >= b._raw; }
+
+private:
+	constexpr Fix16(int32_t raw, int) : _raw(raw) {}
+
+	// products and quotients out of range clamp to the largest/smallest value instead of wrapping
+	static constexpr int32_t _saturate(int64_t v) {
+		return (v > INT32_MAX) ? INT32_MAX : ((v < INT32_MIN) ? INT32_MIN : (int32_t) v);
+	}
+
+	int32_t _raw;
+};
+
+inline Fix16 abs(Fix16 x) {
+	return (x.raw() < 0) ? -x : x;
+}
+
+inline Fix16 floor(Fix16 x) {
+	return Fix16::fromRaw(x.raw() & ~(Fix16::ONE - 1));
+}
+
+inline Fix16 sqrt(Fix16 x) {
+	if (x.raw() <= 0)
+		return Fix16();
+	// integer square root of raw * 2^16 (bit by bit), which is the Q16.16 result.
+	uint64_t v = ((uint64_t) x.raw()) << Fix16::FRAC_BITS;
+	uint64_t r = 0;
+	uint64_t b = ((uint64_t) 1) << 62;
+	while (b > v)
+		b >>= 2;
+	while (b != 0) {
+		if (v >= r + b) {
+			v -= r + b;
+			r = (r >> 1) + b;
+		} else {
+			r >>= 1;
+		}
+		b >>= 2;
+	}
+	return Fix16::fromRaw((int32_t) r);
+}
+
+inline Fix16 sin(Fix16 x) {
+	constexpr Fix16 PI(3.14159265358979);
+	constexpr Fix16 HALF_PI(1.57079632679490);
+	constexpr int32_t TWO_PI_RAW = 411775; // 2pi in Q16.16
+	int32_t r = x.raw() % TWO_PI_RAW; // into ]-pi, pi]
+	if (r > PI.raw())
+		r -= TWO_PI_RAW;
+	else if (r <= -PI.raw())
+		r += TWO_PI_RAW;
+	Fix16 y = Fix16::fromRaw(r);
+	if (y > HALF_PI) // sin(pi - y) = sin(y): fold into [-pi/2, pi/2]
+		y = PI - y;
+	else if (y < -HALF_PI)
+		y = -PI - y;
+	// Taylor series up to y^9, evaluated in Q3.29 (y^2 reaches 2.47) so that the result is
+	// within a couple of units of the last Q16.16 place.
+	auto mul29 = [](int32_t a, int32_t b) {
+		return (int32_t) (((int64_t) a * b) >> 29);
+	};
+	const int32_t y29 = y.raw() << 13;
+	const int32_t y2 = mul29(y29, y29);
+	int32_t s = 1479;                 // 1/9! in Q3.29
+	s = -106522 + mul29(y2, s);       // -1/7!
+	s = 4473924 + mul29(y2, s);       // 1/5!
+	s = -89478485 + mul29(y2, s);     // -1/3!
+	s = (1 << 29) + mul29(y2, s);
+	return Fix16::fromRaw((mul29(y29, s) + (1 << 12)) >> 13);
+}
+
+inline Fix16 cos(Fix16 x) {
+	return sin(x + Fix16(1.57079632679490));
+}
+
+namespace Eigen {
+template<> struct NumTraits<Fix16> : GenericNumTraits<Fix16> {
+	typedef Fix16 Real;
+	typedef Fix16 NonInteger;
+	typedef Fix16 Nested;
+	typedef Fix16 Literal;
+	enum {
+		IsComplex = 0,
+		IsInteger = 0,
+		IsSigned = 1,
+		RequireInitialization = 0,
+		ReadCost = 1,
+		AddCost = 1,
+		MulCost = 2
+	};
+	static inline Real epsilon() { return Fix16::fromRaw(1); }
+	static inline Real dummy_precision() { return Fix16::fromRaw(64); }
+	static inline Real highest() { return Fix16::fromRaw(INT32_MAX); }
+	static inline Real lowest() { return Fix16::fromRaw(INT32_MIN); }
+	static inline int digits10() { return 4; }
+};
+}
@@ -2,50 +2,98 @@
 #include <Eigen/Dense>
 #include "MathUtil.h"
 
-using Vec2d = Eigen::Vector2d;
-using Vec3d = Eigen::Vector3d;
-using Vec4d = Eigen::Vector4d;
-using Mat3d = Eigen::Matrix3d;
+// Scalar type of the 3d pipeline. The Cortex-M4F FPU only executes single precision: double
+// arithmetic becomes software library calls, so keep float unless the precision is needed.
+#ifndef LINALG_USE_DOUBLE
+#define LINALG_USE_DOUBLE 0
+#endif
+
+// Q16.16 fixed point instead (see fix16.h): integer only, for cores without an FPU or to get
+// bit exact results. Coordinates must stay within [-32768, 32768[.
+#ifndef LINALG_USE_FIXED
+#define LINALG_USE_FIXED 0
+#endif
+
+#if LINALG_USE_FIXED
+#include "fix16.h"
+using real_t = Fix16;
+#elif LINALG_USE_DOUBLE
+using real_t = double;
+#else
+using real_t = float;
+#endif
+
+template<typename T> using Vec2T = Eigen::Matrix<T, 2, 1>;
+template<typename T> using Vec3T = Eigen::Matrix<T, 3, 1>;
+template<typename T> using Vec4T = Eigen::Matrix<T, 4, 1>;
+template<typename T> using Mat3T = Eigen::Matrix<T, 3, 3>;
+
+// the pipeline types
+using Vec2 = Vec2T<real_t>;
+using Vec3 = Vec3T<real_t>;
+using Vec4 = Vec4T<real_t>;
+using Mat3 = Mat3T<real_t>;
+
+using Vec2f = Vec2T<float>;
+using Vec3f = Vec3T<float>;
+using Vec4f = Vec4T<float>;
+using Mat3f = Mat3T<float>;
+
+using Vec2d = Vec2T<double>;
+using Vec3d = Vec3T<double>;
+using Vec4d = Vec4T<double>;
+using Mat3d = Mat3T<double>;
+
+constexpr real_t DEG2RAD = real_t(M_PI / 180.0);
+
+// Angle in degrees of time * rate, with the rate in hundredths of a degree per unit of time.
+// The product is reduced into [0, 360[ with integers: neither float nor Q16.16 can hold
+// time * rate after a few minutes.
+real_t periodicAngle(uint32_t time, uint32_t centideg_rate) {
+  const int a = (int) (((uint64_t) time * centideg_rate) % 36000);
+  return real_t(a / 100) + real_t(a % 100) / 100;
+}
 
 // Calculates the distance from a point to a line
-double DistanceToLine(Vec3d const& line_point1, Vec3d const& line_point2) {
-  Vec3d line = line_point2 - line_point1;
-  double t = line_point1.dot(line) / line.norm();
+real_t DistanceToLine(Vec3 const& line_point1, Vec3 const& line_point2) {
+  Vec3 line = line_point2 - line_point1;
+  real_t t = line_point1.dot(line) / line.norm();
   if (t < 0) {
     return line_point1.norm();
   } else if (t > 1) {
     return line_point2.norm();
   } else {
-    Vec3d projection = line_point1 + t * line;
+    Vec3 projection = line_point1 + t * line;
     return projection.norm();
   }
 }
 
-Vec3d Normal(Vec3d const& p1, Vec3d const& p2, Vec3d const& p3) {
-  Vec3d cross = (p2-p1).cross(p3-p1);
+Vec3 Normal(Vec3 const& p1, Vec3 const& p2, Vec3 const& p3) {
+  Vec3 cross = (p2-p1).cross(p3-p1);
   cross.normalize();
   return cross;
 }
 
-double NormToPoint(Vec3d const& t1, Vec3d const& t2, Vec3d const& t3, Vec3d const& p) {
+real_t NormToPoint(Vec3 const& t1, Vec3 const& t2, Vec3 const& t3, Vec3 const& p) {
   // Calculate the normal of the triangle
-  Vec3d normal = Normal(t1,t2,t3);
-  Vec3d vecToP = (p-t1).normalized();
-  double facePoint = -normal.dot(vecToP);
+  Vec3 normal = Normal(t1,t2,t3);
+  Vec3 vecToP = (p-t1).normalized();
+  real_t facePoint = -normal.dot(vecToP);
   return facePoint;
 }
 
-double ShortestDistance(Vec3d const& t1, Vec3d const& t2, Vec3d const& t3) {
+real_t ShortestDistance(Vec3 const& t1, Vec3 const& t2, Vec3 const& t3) {
   // Calculate the normal of the triangle
-  Vec3d normal = Normal(t1,t2,t3);
+  Vec3 normal = Normal(t1,t2,t3);
 
   // Calculate the distance from the point to the plane of the triangle
-  double d = normal.dot(t1);
+  real_t d = normal.dot(t1);
 
   // If the point is on the same side of the plane as the normal, the shortest
   // distance is the distance from the point to the plane
   if (d * normal.dot(t1) > 0) {
-    return std::abs(d);
+    using std::abs;
+    return abs(d);
   }
 
   // Otherwise, the shortest distance is the distance from the point to one of the edges or vertices of the triangle
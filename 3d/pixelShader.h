@@ -17,9 +17,9 @@ const int p[512] = {
 };
 
 
-Vec4d taylorInvSqrt(Vec4d r)
+Vec4 taylorInvSqrt(Vec4 r)
 {
-    return 1.79284291400159 - 0.85373472095314 * r.array();
+    return real_t(1.79284291400159) - real_t(0.85373472095314) * r.array();
 }
 
 /*
@@ -29,9 +29,9 @@ Vec2d fade(Vec2d t)
 }
 */
 
-Vec4d permute(Vec4d x)
+Vec4 permute(Vec4 x)
 {
-    Vec4d y;
+    Vec4 y;
     y[0] = p[int(x(0)) % 256];
     y[1] = p[int(x(1)) % 256];
     y[2] = p[int(x(2)) % 256];
@@ -39,41 +39,42 @@ Vec4d permute(Vec4d x)
     return y;
 }
 
-float cnoise(Vec2d P)
+float cnoise(Vec2 P)
 {
-    Vec4d Pi = Vec4d{floor(P[0]), floor(P[1]), floor(P[0]), floor(P[1])} + Vec4d{0.0, 0.0, 1.0, 1.0};
-    Vec4d Pf = Vec4d{floor(P[0]), floor(P[1]), floor(P[0]), floor(P[1])} - Vec4d{0.0, 0.0, 1.0, 1.0};
-    Pi = Pi.array().unaryExpr([](double x) { return (double)((int)x % 289); });
+    using std::floor;
+    Vec4 Pi = Vec4{floor(P[0]), floor(P[1]), floor(P[0]), floor(P[1])} + Vec4{0, 0, 1, 1};
+    Vec4 Pf = Vec4{floor(P[0]), floor(P[1]), floor(P[0]), floor(P[1])} - Vec4{0, 0, 1, 1};
+    Pi = Pi.array().unaryExpr([](real_t x) { return (real_t)((int)x % 289); });
 
-    Vec4d ix = {Pi[0], Pi[2], Pi[0], Pi[2]};
-    Vec4d iy = {Pi[1], Pi[1], Pi[3], Pi[3]};
-    Vec4d fx = {Pf[0], Pf[2], Pf[0], Pf[2]};
-    Vec4d fy = {Pf[1], Pf[1], Pf[3], Pf[3]};
-    Vec4d i = permute(permute(ix) + iy);
+    Vec4 ix = {Pi[0], Pi[2], Pi[0], Pi[2]};
+    Vec4 iy = {Pi[1], Pi[1], Pi[3], Pi[3]};
+    Vec4 fx = {Pf[0], Pf[2], Pf[0], Pf[2]};
+    Vec4 fy = {Pf[1], Pf[1], Pf[3], Pf[3]};
+    Vec4 i = permute(permute(ix) + iy);
 
-    auto fract = [](Vec4d x) {
-    	return x - Vec4d(x.array().floor());
+    auto fract = [](Vec4 x) -> Vec4 {
+    	return x - Vec4(x.array().floor());
     };
-    Vec4d gx = (fract(i * (1.0 / 41.0)) * 2.0).array() - 1.0;
-    Vec4d gy = gx.array().abs() - 0.5;
-    Vec4d tx = (gx.array() + 0.5).array().floor();
+    Vec4 gx = (fract(i * real_t(1.0 / 41.0)) * real_t(2)).array() - real_t(1);
+    Vec4 gy = gx.array().abs() - real_t(0.5);
+    Vec4 tx = (gx.array() + real_t(0.5)).array().floor();
     gx = gx - tx;
-    Vec2d g00 = Vec2d(gx[0], gy[0]);
-    Vec2d g10 = Vec2d(gx[1], gy[1]);
-    Vec2d g01 = Vec2d(gx[2], gy[2]);
-    Vec2d g11 = Vec2d(gx[3], gy[3]);
-    Vec4d norm = taylorInvSqrt(Vec4d(g00.dot(g00), g01.dot(g01), g10.dot(g10), g11.dot(g11)));
+    Vec2 g00 = Vec2(gx[0], gy[0]);
+    Vec2 g10 = Vec2(gx[1], gy[1]);
+    Vec2 g01 = Vec2(gx[2], gy[2]);
+    Vec2 g11 = Vec2(gx[3], gy[3]);
+    Vec4 norm = taylorInvSqrt(Vec4(g00.dot(g00), g01.dot(g01), g10.dot(g10), g11.dot(g11)));
     g00 *= norm[0];
     g01 *= norm[1];
     g10 *= norm[2];
     g11 *= norm[3];
-    float n00 = g00.dot(Vec2d(fx[0], fy[0]));
-    float n10 = g10.dot(Vec2d(fx[1], fy[1]));
-    float n01 = g01.dot(Vec2d(fx[2], fy[2]));
-    float n11 = g11.dot(Vec2d(fx[3], fy[3]));
-    Vec2d fade_xy = {1, 0.9999};//fade(Vec2d{Pf[0], Pf[1]});
-    Vec2d n_x = lerp(Vec2d(n00, n01), Vec2d(n10, n11), fade_xy[0]);
-    float n_xy = lerp(n_x[0], n_x[1], fade_xy[1]);
-    return 2.3 * n_xy;
+    real_t n00 = g00.dot(Vec2(fx[0], fy[0]));
+    real_t n10 = g10.dot(Vec2(fx[1], fy[1]));
+    real_t n01 = g01.dot(Vec2(fx[2], fy[2]));
+    real_t n11 = g11.dot(Vec2(fx[3], fy[3]));
+    Vec2 fade_xy = {real_t(1), real_t(0.9999)};//fade(Vec2{Pf[0], Pf[1]});
+    Vec2 n_x = Vec2(n00, n01) + (Vec2(n10, n11) - Vec2(n00, n01)) * fade_xy[0];
+    real_t n_xy = n_x[0] + (n_x[1] - n_x[0]) * fade_xy[1];
+    return static_cast<float>(real_t(2.3) * n_xy);
 }
 
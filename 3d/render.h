@@ -10,6 +10,7 @@
 #include "ILI9341Wrapper.h"
 #include "BaseAnimation.h"
 #include "3dPrimitives.h"
+#include "triangleArena.h"
 #include <string>
 #include <optional>
 
@@ -31,11 +32,16 @@ public:
 	uint_fast16_t bgColor(void);
 	std::string title();
 	void perFrame(ILI9341Wrapper &tft, FrameParams frameParams);
+	void prepareFrame(FrameParams frameParams);
+	void draw(ILI9341Wrapper &tft);
 
 private:
+	static const int MAX_TRIANGLES = 256;
+
 	uint_fast16_t _bgColor;
 	uint32_t _time = 0;
 	std::vector<Object*> _scene;
+	TriangleArenaStatic<MAX_TRIANGLES> _triangles; // depth ordered as they are appended
 };
 
 void Render::init(ILI9341Wrapper &tft) {
@@ -51,41 +57,41 @@ std::string Render::title() {
 }
 
 void Render::perFrame(ILI9341Wrapper &tft, FrameParams frameParams) {
-	tft.fillScreen(_bgColor);
+	prepareFrame(frameParams);
+	draw(tft);
+}
+
+void Render::prepareFrame(FrameParams frameParams) {
 	_time++;
 
-	Vec3d camera{};
-	camera[0] = 4.0 * sin(_time * M_PI/180.0);
-	camera[1] = 4.0 * sin(5e8 + 0.77 * _time * M_PI/180.0);
-	camera[2] = 2.0 + 2.0 * cos(0.3 * _time * M_PI/180.0);
+	// 5e8 rad as a phase in [0, 2pi[ (single precision cannot add small angles to it).
+	static const real_t phase = real_t(std::fmod(5e8, 2 * M_PI));
+	using std::sin;
+	using std::cos;
+	Vec3 camera{};
+	camera[0] = 4 * sin(periodicAngle(_time, 100) * DEG2RAD);
+	camera[1] = 4 * sin(phase + periodicAngle(_time, 77) * DEG2RAD);
+	camera[2] = 2 + 2 * cos(periodicAngle(_time, 30) * DEG2RAD);
 
-	std::vector<Triangle> triangles;
+	_triangles.clear();
 	int time_offset = 0;
 	for(Object* o : _scene) {
 		o->update(_time + time_offset);
 		//time_offset += 400;
-		std::vector<Triangle> newTri = o->getTriangles(camera);
-		triangles.insert(triangles.end(), newTri.begin(), newTri.end());
+		o->appendTriangles(camera, _triangles);
 	}
+}
 
-	std::sort(triangles.begin(), triangles.end(),
-			[](Triangle const &t1, Triangle const &t2) {
-				return t1.distFromCamera > t2.distFromCamera;
-			});
-
-	// Draw the triangles
-	for (const Triangle t : triangles) {
-		// the virtual screen -1->1 maps to the LCD screen
-		auto toLCD = [&](double x, double y) -> Vec2d {
-			return Vec2d { static_cast<int>(tft.width() * (1 + x) / 2.0),
-					static_cast<int>(tft.height() * (1 + y) / 2.0)};
-		};
+void Render::draw(ILI9341Wrapper &tft) {
+	tft.fillScreen(_bgColor);
 
-		Vec2d p1 = toLCD(t.p1[0], t.p1[1]);
-		Vec2d p2 = toLCD(t.p2[0], t.p2[1]);
-		Vec2d p3 = toLCD(t.p3[0], t.p3[1]);
-		tft.drawFilledTriangle(p1[0], p1[1], p2[0], p2[1], p3[0], p3[1], t.col);
-	}
+	// Draw the triangles, mapping the focal plane to this screen
+	const int w = tft.width(), h = tft.height();
+	_triangles.forEachBackToFront([&](ScreenTri const &t) {
+		tft.drawFilledTriangle(TriangleArena::toScreen(t.x1, w), TriangleArena::toScreen(t.y1, h),
+				TriangleArena::toScreen(t.x2, w), TriangleArena::toScreen(t.y2, h),
+				TriangleArena::toScreen(t.x3, w), TriangleArena::toScreen(t.y3, h), t.col);
+	});
 //	tft.drawFastHLine(0, tft.height()/2, tft.width(), 0xff00);
 	//tft.drawFastVLine(tft.width()/2, 0, tft.height(), 0x00ff);
 }
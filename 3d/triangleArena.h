@@ -0,0 +1,130 @@
+#pragma once
+#include <stdint.h>
+#include "linalg.h"
+
+// Triangle of a frame: vertices on the focal plane in fixed point (see TriangleArena::toPlane()),
+// a depth key (larger is further), a colour and the link of the ordering table, in 18 bytes.
+struct ScreenTri {
+	int16_t x1, y1, x2, y2, x3, y3;
+	uint16_t depth;
+	uint16_t col;
+	uint16_t next; // next triangle of the same depth bucket
+};
+
+// Fixed capacity list of the triangles of a frame, filled by the objects of the scene
+// (Object::appendTriangles()) and drawn by the renderer. It works on a caller provided buffer
+// and never allocates: when it is full, further triangles are dropped and overflowed() returns
+// true until the next clear().
+//
+// The objects project onto the focal plane ([-1, 1] spans the screen) and store their points
+// with toPlane(). The renderer maps them with toScreen() to the screen it draws to, so the
+// triangles do not depend on its size.
+//
+// The triangles are depth ordered with an ordering table: push() links each one at the head of
+// the list of its depth bucket and forEachBackToFront() walks the buckets from the furthest.
+// Ordering costs O(1) per triangle (plus clearing the table once per frame) instead of a
+// O(n log n) sort. The buckets are 1 / OT_RESOLUTION unit deep and the last one collects
+// everything beyond OT_SIZE / OT_RESOLUTION units: the triangles of a bucket come out latest
+// pushed first.
+class TriangleArena {
+public:
+	// depth key resolution: DEPTH_SCALE keys per unit, up to 0xffff / DEPTH_SCALE units.
+	static const int DEPTH_SCALE = 256;
+
+	static const int OT_SIZE = 1024;     // number of depth buckets
+	static const int OT_SHIFT = 3;       // depth key bits dropped to get the bucket
+	static const int OT_RESOLUTION = DEPTH_SCALE >> OT_SHIFT; // buckets per unit
+	static const uint16_t OT_END = 0xffff; // end of a bucket list
+
+	static const int PLANE_SCALE = 1024; // fixed point units per focal plane unit
+
+	// size is at most 0xffff triangles
+	TriangleArena(ScreenTri *buf, int size) : _buf(buf), _size((size < OT_END) ? size : OT_END) {
+		clear();
+	}
+
+	// forget all the triangles
+	void clear() {
+		_len = 0;
+		_overflow = false;
+		for (int b = 0; b < OT_SIZE; b++) {
+			_ot[b] = OT_END;
+		}
+	}
+
+	// fixed point coordinates of a point of the focal plane. Points far off screen are clamped
+	// to 31 units, which keeps them in int16 (and in Q16.16 on the way).
+	static Point16 toPlane(real_t x, real_t y) {
+		x = clamp(x, real_t(-31), real_t(31));
+		y = clamp(y, real_t(-31), real_t(31));
+		return Point16 { static_cast<int_fast16_t>(static_cast<int>(x * PLANE_SCALE)),
+				static_cast<int_fast16_t>(static_cast<int>(y * PLANE_SCALE))};
+	}
+
+	// screen coordinate of a fixed point plane coordinate, for a screen size pixels wide (or
+	// high)
+	static int16_t toScreen(int p, int size) {
+		return (int16_t) (size * (PLANE_SCALE + p) / (2 * PLANE_SCALE));
+	}
+
+	// depth key of a camera space distance (clamped to [0, 0xffff])
+	static uint16_t depthKey(real_t dist) {
+		if (dist <= real_t(0)) return 0;
+		if (dist >= real_t(0xffff / DEPTH_SCALE)) return 0xffff;
+		return (uint16_t) static_cast<int>(dist * DEPTH_SCALE);
+	}
+
+	// ordering table bucket of a depth key
+	static int bucket(uint16_t depth) {
+		const int b = depth >> OT_SHIFT;
+		return (b < OT_SIZE) ? b : (OT_SIZE - 1);
+	}
+
+	// append a triangle and link it in the ordering table (returns false if dropped)
+	bool push(Point16 const& p1, Point16 const& p2, Point16 const& p3, real_t dist, uint16_t col) {
+		if (_len >= _size) {
+			_overflow = true;
+			return false;
+		}
+		const uint16_t depth = depthKey(dist);
+		const int b = bucket(depth);
+		_buf[_len] = ScreenTri { (int16_t) p1.x, (int16_t) p1.y, (int16_t) p2.x, (int16_t) p2.y,
+				(int16_t) p3.x, (int16_t) p3.y, depth, col, _ot[b] };
+		_ot[b] = (uint16_t) _len++;
+		return true;
+	}
+
+	// call f(const ScreenTri&) on the triangles from the furthest to the nearest (painter's
+	// algorithm)
+	template<typename F> void forEachBackToFront(F f) const {
+		for (int b = OT_SIZE - 1; b >= 0; b--) {
+			for (uint16_t i = _ot[b]; i != OT_END; i = _buf[i].next) {
+				f(_buf[i]);
+			}
+		}
+	}
+
+	int size() const { return _len; }
+	int capacity() const { return _size; }
+	bool overflowed() const { return _overflow; }
+
+	const ScreenTri* begin() const { return _buf; }
+	const ScreenTri* end() const { return _buf + _len; }
+	const ScreenTri& operator[](int i) const { return _buf[i]; }
+
+private:
+	ScreenTri *const _buf;
+	const int _size;
+	int _len;       // triangles in use
+	bool _overflow;
+	uint16_t _ot[OT_SIZE]; // head of each depth bucket
+};
+
+// triangle arena with statically allocated memory for SIZE triangles
+template<int SIZE = 256> class TriangleArenaStatic : public TriangleArena {
+public:
+	TriangleArenaStatic() : TriangleArena(_staticbuf, SIZE) {}
+
+private:
+	ScreenTri _staticbuf[SIZE];
+};
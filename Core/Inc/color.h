@@ -32,3 +32,18 @@ uint16_t mapColor(float value) {
 	return (((uint16_t)(r * 31)) << 11) | (((uint16_t)(g * 63)) << 5)
 			| ((uint16_t)(b * 31));
 }
+
+/**
+ * Fill a 256 entries palette with the mapColor() ramp: index i has the
+ * color mapColor(i / 255) (see mapColorIndex()).
+ **/
+void mapColorPalette(uint16_t *palette) {
+	for (int i = 0; i < 256; i++) {
+		palette[i] = mapColor(i / 255.0f);
+	}
+}
+
+/** palette index of value in a palette filled by mapColorPalette() */
+uint8_t mapColorIndex(float value) {
+	return (uint8_t) (value * 255);
+}
@@ -2,6 +2,7 @@
 #include <complex>
 #include "ili9341.h"
 #include "color.h"
+#include "ILI9341Wrapper.h"
 
 void drawFractal(double x1, double x2, double y1, double y2,
 		int maxIterations) {
@@ -33,6 +34,32 @@ void drawFractal(double x1, double x2, double y1, double y2,
 	}
 }
 
+// Same as above, into an indexed framebuffer: the pixels are indices in a
+// palette filled by mapColorPalette().
+void drawFractal(ILI9341Wrapper8 &tft, double x1, double x2, double y1,
+		double y2, int maxIterations) {
+	int const HEIGHT = tft.height();
+	int const WIDTH = tft.width();
+
+	double x_step = (x2 - x1) / WIDTH;
+	double y_step = (y2 - y1) / HEIGHT;
+
+	for (int y = 0; y < HEIGHT; y++) {
+		std::complex<double> c(x1, y1 + y * y_step);
+		for (int x = 0; x < WIDTH; x++) {
+			std::complex<double> z(0.0, 0.0);
+			int iterations = 0;
+			for (; std::abs(z) < 2.0 && iterations < maxIterations;
+					++iterations) {
+				z = z * z + c;
+			}
+			tft.drawPixel(x, y,
+					mapColorIndex((float) iterations / maxIterations));
+			c += x_step;
+		}
+	}
+}
+
 void test() {
 	int const HEIGHT = lcdGetHeight();
 	int const WIDTH = lcdGetWidth();
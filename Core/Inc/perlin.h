@@ -20,6 +20,8 @@ public:
 	uint_fast16_t bgColor(void);
 	std::string title();
 	void perFrame(ILI9341Wrapper &tft, FrameParams frameParams);
+	void prepareFrame(FrameParams frameParams);
+	void draw(ILI9341Wrapper &tft);
 
 private:
 	uint_fast16_t _bgColor;
@@ -41,12 +43,20 @@ std::string Perlin::title() {
 }
 
 void Perlin::perFrame(ILI9341Wrapper &tft, FrameParams frameParams) {
-	tft.fillScreen(_bgColor);
+	prepareFrame(frameParams);
+	draw(tft);
+}
+
+void Perlin::prepareFrame(FrameParams frameParams) {
 	_time++;
+}
+
+void Perlin::draw(ILI9341Wrapper &tft) {
+	tft.fillScreen(_bgColor);
 
 	for (int x = 0; x < tft.width(); ++x) {
-		for (int y = 0; y < tft.height(); ++y) {
-			tft.drawPixel(x, y, cnoise(Vec2d{50+x,50+y}));
+		for (int y = tft.bandStart(); y < tft.bandEnd(); ++y) {
+			tft.drawPixel(x, y, cnoise(Vec2{50+x,50+y}));
 		}
 	}
 }
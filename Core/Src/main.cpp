@@ -29,12 +29,14 @@ extern "C" {
 }
 #include <stdio.h>
 #include <string.h>
-//#include "fractal.h"
+#include "fractal.h"
 #include "render.h"
 #include "perlin.h"
 #include "ILI9341Wrapper.h"
 #include "FrameParams.h"
 #include "ILI9341Driver.h"
+#include "BandRenderer.h"
+#include "ScaleController.h"
 
 int __io_putchar(int ch) {
 	// Write character to ITM ch.0
@@ -51,6 +53,10 @@ int __io_putchar(int ch) {
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
+#define BAND_RENDERING 0 // 1: render at the native 320x240 in bands instead of the 160x240 framebuffer.
+#define BAND_NBLINES 12
+#define INDEXED_RENDERING 0 // 1: palette cycling on a native 320x240 indexed (8 bits) framebuffer.
+#define SCALED_RENDERING 0 // 1: the render resolution (2x1, 2x2 or 4x4 pixels) follows the render time.
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -61,6 +67,9 @@ int __io_putchar(int ch) {
 /* Private variables ---------------------------------------------------------*/
 SPI_HandleTypeDef hspi2;
 
+TIM_HandleTypeDef htim2;
+
+DMA_HandleTypeDef hdma_memtomem_dma2_stream0;
 SRAM_HandleTypeDef hsram1;
 
 /* USER CODE BEGIN PV */
@@ -70,8 +79,10 @@ SRAM_HandleTypeDef hsram1;
 /* Private function prototypes -----------------------------------------------*/
 void SystemClock_Config(void);
 static void MX_GPIO_Init(void);
+static void MX_DMA_Init(void);
 static void MX_FSMC_Init(void);
 static void MX_SPI2_Init(void);
+static void MX_TIM2_Init(void);
 /* USER CODE BEGIN PFP */
 
 /* USER CODE END PFP */
@@ -120,16 +131,82 @@ int main(void) {
 
 	/* Initialize all configured peripherals */
 	MX_GPIO_Init();
+	MX_DMA_Init();
 	MX_FSMC_Init();
 	MX_SPI2_Init();
+	MX_TIM2_Init();
 	/* USER CODE BEGIN 2 */
 	lcdBacklightOn();
 	lcdInit();
 	lcdSetOrientation(LCD_ORIENTATION_LANDSCAPE);
+	HAL_TIM_Base_Start(&htim2); // free running microsecond clock for the vsync engine.
 
 	ILI9341_T4::ILI9341Driver drv;
 	drv.setRotation(0);
+	drv.setDMA(&hdma_memtomem_dma2_stream0);
+	drv.setVSyncTimer(&htim2);
+	drv.setVSyncSpacing(2); // lock the framerate to half the panel refresh rate.
 	lcdFillRGB(0);
+#if BAND_RENDERING
+	uint16_t *band0 = new uint16_t[320 * BAND_NBLINES];
+	uint16_t *band1 = new uint16_t[320 * BAND_NBLINES];
+	BandRenderer bands(drv, band0, band1, BAND_NBLINES);
+
+	Render demo;
+	//Perlin demo;
+	bands.init(demo);
+	FrameParams fp;
+	fp.timeMult = 1;
+	while (true) {
+		bands.render(demo, fp);
+	}
+#elif SCALED_RENDERING
+	ILI9341_T4::ScaleController scaler(30.0f); // 2x1 down to 4x4.
+	const int fbsize = drv.scaledWidth(scaler.finest()) * drv.scaledHeight(scaler.finest());
+	uint16_t *fb = new uint16_t[fbsize];
+
+	Perlin demo;
+	FrameParams fp;
+	fp.timeMult = 1;
+	const uint16_t *sent = fb; // pixels [sent, sent + sentsize[ are read by the current upload.
+	int sentsize = 0;
+	while (true) {
+		const int mode = scaler.mode();
+		const int size = drv.scaledWidth(mode) * drv.scaledHeight(mode);
+		// when two frames fit in fb (coarser modes), draw in the half that is not being uploaded.
+		uint16_t *dst = ((2 * size <= fbsize) && (sent == fb)) ? fb + size : fb;
+		const uint32_t t0 = __HAL_TIM_GET_COUNTER(&htim2);
+		demo.prepareFrame(fp); // does not touch fb: runs during the previous upload.
+		uint32_t t = __HAL_TIM_GET_COUNTER(&htim2) - t0;
+		if ((dst < sent + sentsize) && (sent < dst + size))
+			drv.waitUploadDone(); // dst is read by the dma until the previous upload completes.
+		const uint32_t t1 = __HAL_TIM_GET_COUNTER(&htim2);
+		ILI9341Wrapper tft(dst, drv.scaledWidth(mode), drv.scaledHeight(mode));
+		demo.draw(tft);
+		t += __HAL_TIM_GET_COUNTER(&htim2) - t1;
+		scaler.update(t);
+		drv.updateScaledAsync(dst, mode); // waits for the previous upload if still ongoing.
+		sent = dst;
+		sentsize = size;
+	}
+#elif INDEXED_RENDERING
+	uint16_t *palette[2] = { new uint16_t[256], new uint16_t[256] };
+	mapColorPalette(palette[0]);
+	drv.setPalette(palette[0]);
+	uint8_t *fb8 = new uint8_t[drv.nativeWidth() * drv.nativeHeight()];
+	ILI9341Wrapper8 tft8(fb8, drv.nativeWidth(), drv.nativeHeight());
+	drawFractal(tft8, -2, 1, -1.5, 1.5, 50); // drawn once: only the palette changes afterwards.
+	int k = 0;
+	while (true) {
+		drv.updateIndexedAsync(fb8, true); // reads palette[k] until the upload completes.
+		// meanwhile, rotate the ramp into the other palette, index 255 (inside the set) stays.
+		memcpy(palette[1 - k], palette[k] + 1, 254 * sizeof(uint16_t));
+		palette[1 - k][254] = palette[k][0];
+		palette[1 - k][255] = palette[k][255];
+		k = 1 - k;
+		drv.setPalette(palette[k]); // waits for the upload.
+	}
+#else
 	uint16_t *fb = new uint16_t[ILI9341_FB_PIXEL_WIDTH * ILI9341_FB_PIXEL_HEIGHT];
 
 	ILI9341Wrapper tft(fb, ILI9341_FB_PIXEL_WIDTH, ILI9341_FB_PIXEL_HEIGHT);
@@ -141,9 +218,15 @@ int main(void) {
 	FrameParams fp;
 	fp.timeMult = 1;
 	while (true) {
-		demo.perFrame(tft, fp);
-		drv.update(fb); // update the screen.
+		// the animation and the projection do not touch fb: they run during the previous upload.
+		// A second 160x240 framebuffer (or the internal one of the driver, see setFramebuffer())
+		// does not fit next to fb in the 128KB of DMA accessible RAM, so drawing waits for it.
+		demo.prepareFrame(fp);
+		drv.waitUploadDone(); // fb is read by the dma until the previous upload completes.
+		demo.draw(tft);
+		drv.updateAsync(fb); // update the screen in the background.
 	}
+#endif
 
 	//test();
 	HAL_Delay(200);
@@ -263,6 +346,48 @@ static void MX_SPI2_Init(void) {
 
 }
 
+/**
+ * @brief TIM2 Initialization Function
+ * @param None
+ * @retval None
+ */
+static void MX_TIM2_Init(void) {
+
+	/* USER CODE BEGIN TIM2_Init 0 */
+
+	/* USER CODE END TIM2_Init 0 */
+
+	TIM_ClockConfigTypeDef sClockSourceConfig = { 0 };
+	TIM_MasterConfigTypeDef sMasterConfig = { 0 };
+
+	/* USER CODE BEGIN TIM2_Init 1 */
+
+	/* USER CODE END TIM2_Init 1 */
+	htim2.Instance = TIM2;
+	htim2.Init.Prescaler = 83;
+	htim2.Init.CounterMode = TIM_COUNTERMODE_UP;
+	htim2.Init.Period = 4294967295;
+	htim2.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+	htim2.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+	if (HAL_TIM_Base_Init(&htim2) != HAL_OK) {
+		Error_Handler();
+	}
+	sClockSourceConfig.ClockSource = TIM_CLOCKSOURCE_INTERNAL;
+	if (HAL_TIM_ConfigClockSource(&htim2, &sClockSourceConfig) != HAL_OK) {
+		Error_Handler();
+	}
+	sMasterConfig.MasterOutputTrigger = TIM_TRGO_RESET;
+	sMasterConfig.MasterSlaveMode = TIM_MASTERSLAVEMODE_DISABLE;
+	if (HAL_TIMEx_MasterConfigSynchronization(&htim2, &sMasterConfig)
+			!= HAL_OK) {
+		Error_Handler();
+	}
+	/* USER CODE BEGIN TIM2_Init 2 */
+
+	/* USER CODE END TIM2_Init 2 */
+
+}
+
 /**
  * @brief GPIO Initialization Function
  * @param None
@@ -311,6 +436,41 @@ static void MX_GPIO_Init(void) {
 
 }
 
+/**
+ * Enable DMA controller clock
+ * Configure DMA for memory to memory transfers
+ *   hdma_memtomem_dma2_stream0
+ */
+static void MX_DMA_Init(void) {
+
+	/* DMA controller clock enable */
+	__HAL_RCC_DMA2_CLK_ENABLE();
+
+	/* Configure DMA request hdma_memtomem_dma2_stream0 on DMA2_Stream0 */
+	hdma_memtomem_dma2_stream0.Instance = DMA2_Stream0;
+	hdma_memtomem_dma2_stream0.Init.Channel = DMA_CHANNEL_0;
+	hdma_memtomem_dma2_stream0.Init.Direction = DMA_MEMORY_TO_MEMORY;
+	hdma_memtomem_dma2_stream0.Init.PeriphInc = DMA_PINC_ENABLE;
+	hdma_memtomem_dma2_stream0.Init.MemInc = DMA_MINC_DISABLE;
+	hdma_memtomem_dma2_stream0.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+	hdma_memtomem_dma2_stream0.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+	hdma_memtomem_dma2_stream0.Init.Mode = DMA_NORMAL;
+	hdma_memtomem_dma2_stream0.Init.Priority = DMA_PRIORITY_HIGH;
+	hdma_memtomem_dma2_stream0.Init.FIFOMode = DMA_FIFOMODE_ENABLE;
+	hdma_memtomem_dma2_stream0.Init.FIFOThreshold = DMA_FIFO_THRESHOLD_FULL;
+	hdma_memtomem_dma2_stream0.Init.MemBurst = DMA_MBURST_SINGLE;
+	hdma_memtomem_dma2_stream0.Init.PeriphBurst = DMA_PBURST_SINGLE;
+	if (HAL_DMA_Init(&hdma_memtomem_dma2_stream0) != HAL_OK) {
+		Error_Handler();
+	}
+
+	/* DMA interrupt init */
+	/* DMA2_Stream0_IRQn interrupt configuration */
+	HAL_NVIC_SetPriority(DMA2_Stream0_IRQn, 1, 0);
+	HAL_NVIC_EnableIRQ(DMA2_Stream0_IRQn);
+
+}
+
 /* FSMC initialization function */
 static void MX_FSMC_Init(void) {
 
@@ -139,6 +139,46 @@ void HAL_SPI_MspDeInit(SPI_HandleTypeDef *hspi) {
 
 }
 
+/**
+ * @brief TIM_Base MSP Initialization
+ * This function configures the hardware resources used in this example
+ * @param htim_base: TIM_Base handle pointer
+ * @retval None
+ */
+void HAL_TIM_Base_MspInit(TIM_HandleTypeDef *htim_base) {
+	if (htim_base->Instance == TIM2) {
+		/* USER CODE BEGIN TIM2_MspInit 0 */
+
+		/* USER CODE END TIM2_MspInit 0 */
+		/* Peripheral clock enable */
+		__HAL_RCC_TIM2_CLK_ENABLE();
+		/* USER CODE BEGIN TIM2_MspInit 1 */
+
+		/* USER CODE END TIM2_MspInit 1 */
+	}
+
+}
+
+/**
+ * @brief TIM_Base MSP De-Initialization
+ * This function freeze the hardware resources used in this example
+ * @param htim_base: TIM_Base handle pointer
+ * @retval None
+ */
+void HAL_TIM_Base_MspDeInit(TIM_HandleTypeDef *htim_base) {
+	if (htim_base->Instance == TIM2) {
+		/* USER CODE BEGIN TIM2_MspDeInit 0 */
+
+		/* USER CODE END TIM2_MspDeInit 0 */
+		/* Peripheral clock disable */
+		__HAL_RCC_TIM2_CLK_DISABLE();
+		/* USER CODE BEGIN TIM2_MspDeInit 1 */
+
+		/* USER CODE END TIM2_MspDeInit 1 */
+	}
+
+}
+
 static uint32_t FSMC_Initialized = 0;
 
 static void HAL_FSMC_MspInit(void) {
@@ -56,6 +56,7 @@
 /* USER CODE END 0 */
 
 /* External variables --------------------------------------------------------*/
+extern DMA_HandleTypeDef hdma_memtomem_dma2_stream0;
 
 /* USER CODE BEGIN EV */
 
@@ -197,6 +198,19 @@ void EXTI9_5_IRQHandler(void) {
 	/* USER CODE END EXTI9_5_IRQn 1 */
 }
 
+/**
+ * @brief This function handles DMA2 stream0 global interrupt.
+ */
+void DMA2_Stream0_IRQHandler(void) {
+	/* USER CODE BEGIN DMA2_Stream0_IRQn 0 */
+
+	/* USER CODE END DMA2_Stream0_IRQn 0 */
+	HAL_DMA_IRQHandler(&hdma_memtomem_dma2_stream0);
+	/* USER CODE BEGIN DMA2_Stream0_IRQn 1 */
+
+	/* USER CODE END DMA2_Stream0_IRQn 1 */
+}
+
 /* USER CODE BEGIN 1 */
 
 /* USER CODE END 1 */
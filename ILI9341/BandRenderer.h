@@ -0,0 +1,97 @@
+#pragma once
+
+#include "ILI9341Driver.h"
+#include "ILI9341Wrapper.h"
+#include "BaseAnimation.h"
+#include "DisplayList.h"
+
+/**
+ * Render an animation at the native panel resolution in horizontal bands
+ * of a few lines instead of a full (pixel doubled) framebuffer.
+ *
+ * The animation state is updated once per frame (prepareFrame()) and the
+ * animation is then drawn once per band (draw()) with the wrapper clipped
+ * to the band. With two band buffers, a band is drawn while the previous
+ * one is streamed to the panel by the DMA.
+ *
+ * Animations that only implement perFrame() can be rendered the same way
+ * with renderRecorded(): perFrame() runs once with the wrapper recording
+ * its draw calls in a display list, which is then replayed for each band.
+ *
+ * Each band buffer holds nblines * drv.nativeWidth() pixels and must be
+ * word aligned and DMA accessible (not in CCM RAM). Two bands of 12 lines
+ * take 15KB, a fifth of the 160x240 framebuffer.
+ **/
+class BandRenderer {
+
+public:
+
+	/** buf1 may be nullptr: a single buffer is then drawn and sent in turn. */
+	BandRenderer(ILI9341_T4::ILI9341Driver &drv, uint16_t *buf0,
+			uint16_t *buf1, int nblines) :
+			_drv(drv), _nblines(nblines), _tft(buf0, drv.nativeWidth(),
+					drv.nativeHeight()) {
+		_buf[0] = buf0;
+		_buf[1] = buf1;
+	}
+
+	/** initialise the animation against the native resolution screen */
+	void init(BaseAnimation &anim) {
+		anim.init(_tft);
+	}
+
+	/** render and upload a whole frame */
+	void render(BaseAnimation &anim, FrameParams frameParams) {
+		anim.prepareFrame(frameParams);
+		_renderBands([&]() {
+			anim.draw(_tft);
+		});
+	}
+
+	/**
+	 * Render and upload a whole frame of an animation drawing from perFrame(): its draw calls 
+	 * are recorded in dl and replayed for each band. Returns false if dl was too small (the 
+	 * commands that did not fit are missing from the frame). 
+	 **/
+	bool renderRecorded(BaseAnimation &anim, FrameParams frameParams,
+			DisplayList &dl) {
+		_tft = ILI9341Wrapper(_buf[0], _drv.nativeWidth(),
+				_drv.nativeHeight());
+		_tft.setBand(_buf[0], 0, 0); // nothing can be drawn while recording anyway.
+		dl.clear();
+		_tft.setRecord(&dl);
+		anim.perFrame(_tft, frameParams);
+		_tft.setRecord(nullptr);
+		_renderBands([&]() {
+			_tft.replay(dl);
+		});
+		return !dl.overflowed();
+	}
+
+private:
+
+	/** draw (with drawband()) and upload each band in turn */
+	template<typename F> void _renderBands(F drawband) {
+		_tft = ILI9341Wrapper(_buf[0], _drv.nativeWidth(),
+				_drv.nativeHeight()); // in case the rotation changed.
+		const int ly = _drv.nativeHeight();
+		int k = 0;
+		for (int y = 0; y < ly; y += _nblines) {
+			const int n = (y + _nblines <= ly) ? _nblines : (ly - y);
+			if (_buf[1] == nullptr)
+				_drv.waitUploadDone(); // the only buffer may still be on its way out.
+			// else: the upload using _buf[k] completed when the previous band was started.
+			_tft.setBand(_buf[k], y, n);
+			drawband();
+			_drv.updateBandAsync(_buf[k], y, n);
+			if (_buf[1] != nullptr)
+				k = 1 - k;
+		}
+	}
+
+	ILI9341_T4::ILI9341Driver &_drv;
+	uint16_t *_buf[2];
+	int _nblines;
+	ILI9341Wrapper _tft;
+
+};
@@ -21,6 +21,11 @@ public:
 	virtual bool forceTransitionNow(void);
 
 	virtual void perFrame(ILI9341Wrapper &tft, FrameParams frameParams);
+
+	// Band rendering (see BandRenderer): prepareFrame() is called once per frame,
+	// then draw() once per band with tft clipped to the band.
+	virtual void prepareFrame(FrameParams frameParams);
+	virtual void draw(ILI9341Wrapper &tft);
 };
 
 void BaseAnimation::init(ILI9341Wrapper &tft) {
@@ -53,4 +58,12 @@ void BaseAnimation::perFrame(ILI9341Wrapper &tft, FrameParams frameParams) {
 	// Extend me
 }
 
+void BaseAnimation::prepareFrame(FrameParams frameParams) {
+	// Extend me
+}
+
+void BaseAnimation::draw(ILI9341Wrapper &tft) {
+	// Extend me
+}
+
 #endif
@@ -1,5 +1,9 @@
 #include "DiffBuff.h"
+#include <cassert>
 #include <cstring>
+#if ILI9341_T4_DIFF_USE_CRC
+#include "main.h"
+#endif
 
 namespace ILI9341_T4 {
 
@@ -33,6 +37,36 @@ void DiffBuffBase::rotationBox(int orientation, int xmin, int xmax, int ymin,
 	}
 }
 
+void DiffBuffBase::inverseRotationBox(int orientation, int x1, int x2, int y1,
+		int y2, int &xmin, int &xmax, int &ymin, int &ymax) {
+	switch (orientation) {
+	case LANDSCAPE_320x240:
+		xmin = y1;
+		xmax = y2;
+		ymin = DiffBuffBase::LX - 1 - x2;
+		ymax = DiffBuffBase::LX - 1 - x1;
+		break;
+	case PORTRAIT_240x320_FLIPPED:
+		xmin = DiffBuffBase::LX - 1 - x2;
+		xmax = DiffBuffBase::LX - 1 - x1;
+		ymin = DiffBuffBase::LY - 1 - y2;
+		ymax = DiffBuffBase::LY - 1 - y1;
+		break;
+	case LANDSCAPE_320x240_FLIPPED:
+		xmin = DiffBuffBase::LY - 1 - y2;
+		xmax = DiffBuffBase::LY - 1 - y1;
+		ymin = x1;
+		ymax = x2;
+		break;
+	default: // case PORTRAIT_240x320:
+		xmin = x1;
+		xmax = x2;
+		ymin = y1;
+		ymax = y2;
+		break;
+	}
+}
+
 void DiffBuffBase::copyfb(uint16_t *fb_old, const uint16_t *fb_new,
 		int fb_new_orientation) {
 	switch (fb_new_orientation) {
@@ -243,9 +277,58 @@ void DiffBuff::_computeDiff0(uint16_t *fb_old, const uint16_t *fb_new, int gap,
 	int cgap = 0;   // current gap size;
 	int pos = 0;    // number of pixel written in diffbuf
 	int n = 0;      // current offset
-	int m = 0;
-	while (m < DiffBuffBase::LX * DiffBuffBase::LY) {
-		COMPUTE_DIFF_LOOP((m++))
+	if ((((uintptr_t) fb_old) | ((uintptr_t) fb_new)) & 3) { // not word aligned: one pixel at a time.
+		int m = 0;
+		while (m < DiffBuffBase::LX * DiffBuffBase::LY) {
+			COMPUTE_DIFF_LOOP((m++))
+		}
+		COMPUTE_DIFF_END
+		return;
+	}
+	// compare 2 pixels per word, the mask being replicated in both halves.
+	const uint32_t mask32 = (USE_MASK) ?
+			(((uint32_t) compare_mask) | (((uint32_t) compare_mask) << 16)) :
+			0xFFFFFFFF;
+	const uint32_t *old32 = (const uint32_t*) fb_old;
+	const uint32_t *new32 = (const uint32_t*) fb_new;
+	const int nbwords = (DiffBuffBase::LX * DiffBuffBase::LY) / 2;
+	int w = 0;
+	while (w < nbwords) {
+		// fast scan over identical stretches, 4 pixels at a time (LDRD pairs on the M4).
+		while ((w + 2 <= nbwords)
+				&& ((((old32[w] ^ new32[w]) | (old32[w + 1] ^ new32[w + 1]))
+						& mask32) == 0)) {
+			w += 2;
+		}
+		cgap += 2 * w - n; // every pixel skipped extends the current gap.
+		n = 2 * w;
+		if (w >= nbwords)
+			break;
+		const uint32_t d = (old32[w] ^ new32[w]) & mask32;
+		w++;
+		if (d == 0) {
+			cgap += 2;
+			n += 2;
+			continue;
+		}
+		{ // low half first: it is the pixel with the lower address.
+			const int ind = n;
+			if (d & 0xFFFF)
+				COMPUTE_DIFF_LOOP_SUB
+			else {
+				cgap++;
+			}
+			n++;
+		}
+		{
+			const int ind = n;
+			if (d >> 16)
+				COMPUTE_DIFF_LOOP_SUB
+			else {
+				cgap++;
+			}
+			n++;
+		}
 	}
 	COMPUTE_DIFF_END
 }
@@ -311,6 +394,7 @@ void DiffBuff::computeDiff(uint16_t *fb_old, const uint16_t *fb_new,
 	if ((fb_new_orientation < 0) || (fb_new_orientation > 3))
 		fb_new_orientation = 0;
 	_posw = 0; // reset buffer
+	_overflow = false;
 	if ((_sizebuf <= 0) || (fb_old == nullptr) || (fb_new == nullptr)) {
 		_write_encoded(TAG_END);
 		_posw = 0;
@@ -342,6 +426,7 @@ void DiffBuff::computeDiff(uint16_t *fb_old, const uint16_t *fb_new,
 }
 
 int DiffBuff::readDiff(int &x, int &y, int &len, int scanline) {
+	scanline = scanlineRow(scanline); // work in framebuffer rows from now on.
 	if (!_r_cont) { // we must load a new instruction.
 		int nb_write, nb_skip;
 		while (1) {
@@ -373,7 +458,7 @@ int DiffBuff::readDiff(int &x, int &y, int &len, int scanline) {
 			&& (_r_y + MIN_SCANLINE_SPACE > scanline)) { // we must wait a bit.
 		len = 0;
 		const int l = _r_y + MIN_SCANLINE_SPACE;
-		return ((l < DiffBuffBase::LY) ? l : DiffBuffBase::LY);
+		return panelY((l < DiffBuffBase::LY) ? l : DiffBuffBase::LY);
 	}
 	if (_r_x > 0) { // not at the beginning of a line.
 		if (_r_x + _r_len <= DiffBuffBase::LX) { // everything fits on the line
@@ -414,6 +499,7 @@ void DiffBuff::computeDiff(uint16_t *fb_old, DiffBuffBase *diff_old,
 	if ((fb_new_orientation < 0) || (fb_new_orientation > 3))
 		fb_new_orientation = 0;
 	_posw = 0; // reset buffer
+	_overflow = false;
 	if ((_sizebuf <= 0) || (fb_old == nullptr) || (sub_fb_new == nullptr)) {
 		_write_encoded(TAG_END);
 		_posw = 0;
@@ -662,9 +748,472 @@ void DiffBuff::_computeDiff(uint16_t *fb_old, DiffBuffBase *diff_old,
 
 }
 
+DiffBuffSig::DiffBuffSig(uint32_t *sig, int nbseg, uint8_t *buffer,
+		size_t sizebuf) :
+		DiffBuff(buffer, sizebuf), _sig(sig), _nbseg(nbseg) {
+	if ((_nbseg < 1) || (((DiffBuffBase::LX / 2) % _nbseg) != 0))
+		_nbseg = 1;
+#if ILI9341_T4_DIFF_USE_CRC
+	__HAL_RCC_CRC_CLK_ENABLE();
+#endif
+	invalidate();
+}
+
+void DiffBuffSig::invalidate() {
+	for (int i = 0; i < DiffBuffBase::LY * _nbseg; i++)
+		_sig[i] = SIG_INVALID;
+}
+
+uint32_t DiffBuffSig::_signature(const uint32_t *p, int nbwords,
+		uint32_t mask32) {
+	uint32_t h;
+#if ILI9341_T4_DIFF_USE_CRC
+	CRC->CR = CRC_CR_RESET;
+	for (int i = 0; i < nbwords; i++)
+		CRC->DR = p[i] & mask32;
+	h = CRC->DR;
+#else
+	h = 2166136261u; // FNV-1a, one word at a time.
+	for (int i = 0; i < nbwords; i++)
+		h = (h ^ (p[i] & mask32)) * 16777619u;
+#endif
+	return (h == SIG_INVALID) ? (SIG_INVALID - 1) : h;
+}
+
+void DiffBuffSig::computeDiff(uint16_t *fb_old, const uint16_t *fb_new,
+		int fb_new_orientation, int gap, bool copy_new_over_old,
+		uint16_t compare_mask) {
+	if (gap < 1)
+		gap = 1;
+	_posw = 0; // reset buffer
+	_overflow = false;
+	if ((fb_new == nullptr) || (fb_new_orientation != 0)
+			|| (((uintptr_t) fb_new) & 3)) { // cannot sign it: redraw everything.
+		if (copy_new_over_old)
+			invalidate();
+		_write_encoded(TAG_WRITE_ALL);
+		_write_encoded(TAG_END);
+		return;
+	}
+	const uint32_t mask32 = ((compare_mask != 0) && (compare_mask != 0xffff)) ?
+			(((uint32_t) compare_mask) | (((uint32_t) compare_mask) << 16)) :
+			0xFFFFFFFF;
+	const int seglen = DiffBuffBase::LX / _nbseg; // pixels per segment (even)
+	const uint32_t *p = (const uint32_t*) fb_new;
+	bool full = false; // true once the diff buffer overflowed (signatures are still updated).
+	int cgap = 0;   // current gap size;
+	int pos = 0;    // number of pixel written in diffbuf
+	int n = 0;      // current offset
+	for (int s = 0; s < DiffBuffBase::LY * _nbseg; s++) {
+		const uint32_t h = _signature(p, seglen / 2, mask32);
+		p += seglen / 2;
+		if (h != _sig[s]) {
+			if (copy_new_over_old)
+				_sig[s] = h;
+			if ((cgap >= gap) && (!full)) {
+				if (!_write_chunk(n - pos - cgap, cgap))
+					full = true;
+				pos = n;
+			}
+			cgap = 0;
+		} else {
+			cgap += seglen;
+		}
+		n += seglen;
+	}
+	if ((!full) && (n - pos - cgap != 0))
+		_write_chunk(n - pos - cgap, cgap);
+	_write_encoded(TAG_END);
+}
+
+void DiffBuffSig::computeDiff(uint16_t *fb_old, DiffBuffBase *diff_old,
+		const uint16_t *sub_fb_new, int xmin, int xmax, int ymin, int ymax,
+		int stride, int fb_new_orientation, int gap, bool copy_new_over_old,
+		uint16_t compare_mask) {
+	if ((fb_new_orientation < 0) || (fb_new_orientation > 3))
+		fb_new_orientation = 0;
+	int x1, x2, y1, y2;
+	DiffBuffBase::rotationBox(fb_new_orientation, xmin, xmax, ymin, ymax, x1,
+			x2, y1, y2);
+	if (x1 < 0)
+		x1 = 0;
+	if (y1 < 0)
+		y1 = 0;
+	if (x2 >= DiffBuffBase::LX)
+		x2 = DiffBuffBase::LX - 1;
+	if (y2 >= DiffBuffBase::LY)
+		y2 = DiffBuffBase::LY - 1;
+	const int seglen = DiffBuffBase::LX / _nbseg;
+	for (int j = y1; j <= y2; j++) {
+		for (int s = x1 / seglen; s <= x2 / seglen; s++)
+			_sig[j * _nbseg + s] = SIG_INVALID;
+	}
+	_posw = 0;
+	_overflow = false;
+	_write_encoded(TAG_END);
+}
+
+/******************************************************************************************
+ * DiffBuffRect
+ *******************************************************************************************/
+
+DiffBuffRect::DiffBuffRect(Rect *rects, int maxrects) :
+		DiffBuffBase(), _rects(rects), _maxrects(maxrects), _nbrects(0), _overflow(
+				false), _nbopen(0) {
+	assert((rects != nullptr) && (maxrects >= MIN_RECTS)); // as DiffBuffRectStatic checks MAXRECTS.
+	setCostModel();
+	initRead();
+	initRaw();
+}
+
+void DiffBuffRect::setCostModel(int pixel_cost, int window_cost) {
+	_pixel_cost = (pixel_cost < 1) ? 1 : pixel_cost;
+	_window_cost = (window_cost < 1) ? 1 : window_cost;
+}
+
+void DiffBuffRect::computeDiff(uint16_t *fb_old, const uint16_t *fb_new,
+		int fb_new_orientation, int gap, bool copy_new_over_old,
+		uint16_t compare_mask) {
+	const int w = (fb_new_orientation & 1) ? DiffBuffBase::LY : DiffBuffBase::LX;
+	const int h = (fb_new_orientation & 1) ? DiffBuffBase::LX : DiffBuffBase::LY;
+	computeDiff(fb_old, nullptr, fb_new, 0, w - 1, 0, h - 1, w,
+			fb_new_orientation, gap, copy_new_over_old, compare_mask);
+}
+
+void DiffBuffRect::computeDiff(uint16_t *fb_old, DiffBuffBase *diff_old,
+		const uint16_t *sub_fb_new, int xmin, int xmax, int ymin, int ymax,
+		int stride, int fb_new_orientation, int gap, bool copy_new_over_old,
+		uint16_t compare_mask) {
+	if (gap < 1)
+		gap = 1;
+	if ((fb_new_orientation < 0) || (fb_new_orientation > 3))
+		fb_new_orientation = 0;
+	_nbrects = 0;
+	_overflow = false;
+	if (diff_old) { // keep the changes of the previous diff.
+		if (diff_old->rectangles()) {
+			int x, y, w, h;
+			diff_old->initRead();
+			while (diff_old->readRect(x, y, w, h, DiffBuffBase::PANEL_LY) == 0)
+				_emit(x, y, w, h);
+		} else { // runs: keep the band of lines they cover.
+			const int nbpix = DiffBuffBase::LX * DiffBuffBase::LY;
+			int nb_write, nb_skip;
+			int off = 0, first = -1, last = -1;
+			diff_old->initRaw();
+			while (off < nbpix) {
+				diff_old->readRaw(nb_write, nb_skip);
+				if (nb_skip > nbpix)
+					break; // TAG_END
+				if (nb_write > nbpix)
+					nb_write = nbpix - off; // TAG_WRITE_ALL
+				if (nb_write > 0) {
+					if (first < 0)
+						first = off;
+					last = off + nb_write - 1;
+				}
+				off += nb_write + nb_skip;
+			}
+			if (first >= 0)
+				_emit(0, first / DiffBuffBase::LX, DiffBuffBase::LX,
+						last / DiffBuffBase::LX - first / DiffBuffBase::LX + 1);
+		}
+	}
+	if ((fb_old != nullptr) && (sub_fb_new != nullptr)) {
+		int x1, x2, y1, y2;
+		DiffBuffBase::rotationBox(fb_new_orientation, xmin, xmax, ymin, ymax,
+				x1, x2, y1, y2);
+		_compare(fb_old, sub_fb_new, x1, x2, y1, y2, stride, fb_new_orientation,
+				gap, copy_new_over_old, compare_mask);
+	}
+}
+
+void DiffBuffRect::_compare(uint16_t *fb_old, const uint16_t *sub_fb_new,
+		int x1, int x2, int y1, int y2, int stride, int fb_new_orientation,
+		int gap, bool copy_new_over_old, uint16_t compare_mask) {
+	if (compare_mask == 0)
+		compare_mask = 0xFFFF;
+	_nbopen = 0;
+	for (int yc = y1; yc <= y2; yc++) {
+		int m = 0, mdelta = 0; // position of (x1, yc) in sub_fb_new and step along the line.
+		switch (fb_new_orientation) {
+		case PORTRAIT_240x320:
+			m = stride * (yc - y1);
+			mdelta = 1;
+			break;
+		case LANDSCAPE_320x240:
+			m = (yc - y1) + stride * (x2 - x1);
+			mdelta = -stride;
+			break;
+		case PORTRAIT_240x320_FLIPPED:
+			m = stride * (y2 - yc) + (x2 - x1);
+			mdelta = -1;
+			break;
+		case LANDSCAPE_320x240_FLIPPED:
+			m = y2 - yc;
+			mdelta = stride;
+			break;
+		}
+		uint16_t *po = fb_old + DiffBuffBase::LX * yc;
+		int start = -1, last = 0; // current run [start, last]
+		for (int x = x1; x <= x2; x++, m += mdelta) {
+			const uint16_t v = sub_fb_new[m];
+			if ((po[x] ^ v) & compare_mask) {
+				if (copy_new_over_old)
+					po[x] = v;
+				if (start < 0) {
+					start = x;
+				} else if (x - last > gap) { // at least gap identical pixels: new run.
+					_addRun(yc, start, last);
+					start = x;
+				}
+				last = x;
+			}
+		}
+		if (start >= 0)
+			_addRun(yc, start, last);
+		_closeRects(yc);
+	}
+	_closeRects(y2 + 1);
+}
+
+void DiffBuffRect::_addRun(int y, int a, int b) {
+	int best = -1;
+	int bestcost = _window_cost + _pixel_cost * (b - a + 1); // cost of a new rectangle.
+	for (int i = 0; i < _nbopen; i++) {
+		const Rect &r = _open[i];
+		const int x0 = (a < r.x) ? a : r.x;
+		const int x1 = (b > r.x + r.w - 1) ? b : (r.x + r.w - 1);
+		// growing r costs the pixels added to it (the new ones and the unchanged ones).
+		const int cost = _pixel_cost * ((x1 - x0 + 1) * (y - r.y + 1) - r.w * r.h);
+		if (cost <= bestcost) {
+			best = i;
+			bestcost = cost;
+		}
+	}
+	if (best >= 0) {
+		Rect &r = _open[best];
+		const int x1 = (b > r.x + r.w - 1) ? b : (r.x + r.w - 1);
+		if (a < r.x)
+			r.x = a;
+		r.w = x1 - r.x + 1;
+		r.h = y - r.y + 1;
+		return;
+	}
+	if (_nbopen == MAX_OPEN) { // too many: stop growing the oldest one.
+		_emit(_open[0].x, _open[0].y, _open[0].w, _open[0].h);
+		for (int i = 1; i < _nbopen; i++)
+			_open[i - 1] = _open[i];
+		_nbopen--;
+	}
+	Rect &r = _open[_nbopen++];
+	r.x = a;
+	r.y = y;
+	r.w = b - a + 1;
+	r.h = 1;
+}
+
+void DiffBuffRect::_closeRects(int y) {
+	int k = 0;
+	for (int i = 0; i < _nbopen; i++) {
+		const Rect &r = _open[i];
+		if (r.y + r.h <= y)
+			_emit(r.x, r.y, r.w, r.h);
+		else
+			_open[k++] = r;
+	}
+	_nbopen = k;
+}
+
+void DiffBuffRect::_emit(int x, int y, int w, int h) {
+	if (_nbrects < _maxrects) {
+		// insert, keeping the rectangles sorted by last line: the rectangles of the old diff and
+		// those stopped early when too many are growing can end below the ones emitted after them.
+		int j = _nbrects++;
+		while ((j > 0) && (_rects[j - 1].y + _rects[j - 1].h > y + h)) {
+			_rects[j] = _rects[j - 1];
+			j--;
+		}
+		Rect &r = _rects[j];
+		r.x = x;
+		r.y = y;
+		r.w = w;
+		r.h = h;
+		return;
+	}
+	_overflow = true;
+	// no room: grow the last rectangle to cover both (it still ends on the last line).
+	Rect &r = _rects[_nbrects - 1];
+	const int x1 = ((x + w) > (r.x + r.w)) ? (x + w) : (r.x + r.w);
+	const int y1 = ((y + h) > (r.y + r.h)) ? (y + h) : (r.y + r.h);
+	if (x < r.x)
+		r.x = x;
+	if (y < r.y)
+		r.y = y;
+	r.w = x1 - r.x;
+	r.h = y1 - r.y;
+}
+
+void DiffBuffRect::clear() {
+	_nbrects = 0;
+	_overflow = false;
+	initRead();
+	initRaw();
+}
+
+void DiffBuffRect::addRect(int xmin, int xmax, int ymin, int ymax,
+		int fb_orientation) {
+	if ((fb_orientation < 0) || (fb_orientation > 3))
+		fb_orientation = 0;
+	int x1, x2, y1, y2;
+	DiffBuffBase::rotationBox(fb_orientation, xmin, xmax, ymin, ymax, x1, x2,
+			y1, y2);
+	if (x1 < 0)
+		x1 = 0;
+	if (x2 > DiffBuffBase::LX - 1)
+		x2 = DiffBuffBase::LX - 1;
+	if (y1 < 0)
+		y1 = 0;
+	if (y2 > DiffBuffBase::LY - 1)
+		y2 = DiffBuffBase::LY - 1;
+	if ((x1 > x2) || (y1 > y2))
+		return;
+	Rect r;
+	r.x = x1;
+	r.y = y1;
+	r.w = x2 - x1 + 1;
+	r.h = y2 - y1 + 1;
+	while (1) { // merge with the cheapest rectangle while it pays (or while there is no room).
+		int best = -1, bestcost = 0;
+		for (int i = 0; i < _nbrects; i++) {
+			const int c = _mergeCost(_rects[i], r);
+			if ((best < 0) || (c < bestcost)) {
+				best = i;
+				bestcost = c;
+			}
+		}
+		if ((best < 0) || ((bestcost > 0) && (_nbrects < _maxrects)))
+			break;
+		if (bestcost > 0)
+			_overflow = true;
+		const Rect &o = _rects[best];
+		const int ux2 = ((o.x + o.w) > (r.x + r.w)) ? (o.x + o.w) : (r.x + r.w);
+		const int uy2 = ((o.y + o.h) > (r.y + r.h)) ? (o.y + o.h) : (r.y + r.h);
+		if (o.x < r.x)
+			r.x = o.x;
+		if (o.y < r.y)
+			r.y = o.y;
+		r.w = ux2 - r.x;
+		r.h = uy2 - r.y;
+		for (int i = best + 1; i < _nbrects; i++) // the union may move: remove the old one.
+			_rects[i - 1] = _rects[i];
+		_nbrects--;
+	}
+	int j = _nbrects++; // insert, keeping the rectangles sorted by last line.
+	while ((j > 0) && (_rects[j - 1].y + _rects[j - 1].h > r.y + r.h)) {
+		_rects[j] = _rects[j - 1];
+		j--;
+	}
+	_rects[j] = r;
+}
+
+int DiffBuffRect::_mergeCost(const Rect &a, const Rect &b) const {
+	const int x1 = (a.x < b.x) ? a.x : b.x;
+	const int y1 = (a.y < b.y) ? a.y : b.y;
+	const int x2 = ((a.x + a.w) > (b.x + b.w)) ? (a.x + a.w) : (b.x + b.w);
+	const int y2 = ((a.y + a.h) > (b.y + b.h)) ? (a.y + a.h) : (b.y + b.h);
+	// overlapping pixels count twice when sent separately.
+	return _pixel_cost * ((x2 - x1) * (y2 - y1) - a.w * a.h - b.w * b.h)
+			- _window_cost;
+}
+
+void DiffBuffRect::initRead() {
+	_r_i = 0;
+	_r_h = 0;
+	_d_h = 0;
+}
+
+int DiffBuffRect::readRect(int &x, int &y, int &w, int &h, int scanline) {
+	if (_r_h <= 0) { // load the next rectangle.
+		if (_r_i >= _nbrects)
+			return -1; // done !
+		const Rect &r = _rects[_r_i++];
+		_r_x = r.x;
+		_r_y = r.y;
+		_r_w = r.w;
+		_r_h = r.h;
+	}
+	x = _r_x;
+	y = _r_y;
+	w = _r_w;
+	scanline = scanlineRow(scanline); // work in framebuffer rows from now on.
+	if ((scanline < DiffBuffBase::LY)
+			&& (_r_y + MIN_SCANLINE_SPACE > scanline)) { // we must wait a bit.
+		h = 0;
+		const int l = _r_y + MIN_SCANLINE_SPACE;
+		return panelY((l < DiffBuffBase::LY) ? l : DiffBuffBase::LY);
+	}
+	int maxl = scanline - _r_y; // max number of lines available now
+	if (maxl > MAX_WRITE_LINE)
+		maxl = MAX_WRITE_LINE; // clamp at max value.
+	h = (_r_h <= maxl) ? _r_h : maxl;
+	_r_y += h;
+	_r_h -= h;
+	return 0;
+}
+
+int DiffBuffRect::readDiff(int &x, int &y, int &len, int scanline) {
+	if (_d_h <= 0) { // next part of a rectangle.
+		int h = 0;
+		const int r = readRect(_d_x, _d_y, _d_w, h, scanline);
+		if (r != 0) {
+			x = _d_x;
+			y = _d_y;
+			len = 0;
+			return r;
+		}
+		_d_h = h;
+	}
+	x = _d_x;
+	y = _d_y++;
+	len = _d_w;
+	_d_h--;
+	return 0;
+}
+
+void DiffBuffRect::initRaw() {
+	_raw = 0;
+	_raw_y1 = DiffBuffBase::LY;
+	_raw_y2 = -1;
+	for (int i = 0; i < _nbrects; i++) {
+		if (_rects[i].y < _raw_y1)
+			_raw_y1 = _rects[i].y;
+		if (_rects[i].y + _rects[i].h - 1 > _raw_y2)
+			_raw_y2 = _rects[i].y + _rects[i].h - 1;
+	}
+}
+
+void DiffBuffRect::readRaw(int &nbwrite, int &nbskip) {
+	if ((_raw == 0) && (_raw_y2 >= 0)) {
+		nbwrite = 0;
+		nbskip = DiffBuffBase::LX * _raw_y1;
+		_raw = 1;
+		return;
+	}
+	if (_raw == 1) {
+		nbwrite = DiffBuffBase::LX * (_raw_y2 - _raw_y1 + 1);
+		nbskip = DiffBuffBase::LX * (DiffBuffBase::LY - 1 - _raw_y2);
+		_raw = 2;
+		return;
+	}
+	nbwrite = 0;
+	nbskip = DiffBuffBase::LX * DiffBuffBase::LY + 1;
+}
+
 int DiffBuffDummy::readDiff(int &x, int &y, int &len, int scanline) {
 	if (_current_line >= _end)
 		return -1; // we are done.
+	scanline = scanlineRow(scanline); // work in framebuffer rows from now on.
 	if (scanline >= _end) { // scanline after end of drawing, go as fast as possible.
 		x = 0;
 		y = _current_line;
@@ -680,7 +1229,7 @@ int DiffBuffDummy::readDiff(int &x, int &y, int &len, int scanline) {
 	int maxl = scanline - _current_line; // number of line available for drawing.
 	if (maxl < MIN_SCANLINE_SPACE) { // we must wait a bit.
 		const int l = _current_line + MIN_SCANLINE_SPACE;
-		return ((l < _end) ? l : _end);
+		return panelY((l < _end) ? l : _end);
 	}
 	x = 0;
 	y = _current_line;
@@ -25,13 +25,29 @@
 // only C++, no plain C
 #ifdef __cplusplus
 
-//#include "StatsVar.h"
-
 #include <math.h>
 #include <cstdint>
 
 #define ILI9341_T4_ALWAYS_INLINE __attribute__((always_inline))
 
+#ifndef ILI9341_T4_DIFF_USE_CRC
+#define ILI9341_T4_DIFF_USE_CRC 1  // 1 = row signatures (DiffBuffSig) from the STM32 CRC unit, 0 = software hash.
+#endif
+
+/** Diff geometry: framebuffer size in orientation 0 and how each framebuffer pixel maps onto the panel. */
+#ifndef ILI9341_T4_DIFF_LX
+#define ILI9341_T4_DIFF_LX 160     // framebuffer width (ILI9341_FB_PIXEL_WIDTH)
+#endif
+#ifndef ILI9341_T4_DIFF_LY
+#define ILI9341_T4_DIFF_LY 240     // framebuffer height (ILI9341_FB_PIXEL_HEIGHT)
+#endif
+#ifndef ILI9341_T4_DIFF_SCALE_X
+#define ILI9341_T4_DIFF_SCALE_X 2  // panel columns per framebuffer column (pixel doubling on upload)
+#endif
+#ifndef ILI9341_T4_DIFF_SCALE_Y
+#define ILI9341_T4_DIFF_SCALE_Y 1  // panel rows (and scanlines) per framebuffer row
+#endif
+
 namespace ILI9341_T4 {
 
 /******************************************************************************************
@@ -52,6 +68,8 @@ namespace ILI9341_T4 {
  * - DiffBuff      : diff using user-supplied memory.
  * - DiffBuffStatic: diff using static memory allocation.
  * - DiffBuffDummy : diff without memory alloc holding only trivial diffs.
+ * - DiffBuffSig   : diff from row signatures, without the old framebuffer.
+ * - DiffBuffRect  : diff made of rectangles chosen with a bus cost model.
  *
  *******************************************************************************************/
 class DiffBuffBase {
@@ -65,12 +83,35 @@ public:
 		LANDSCAPE_320x240_FLIPPED = 3,
 	};
 
-	static const int LX = 240;             // framebuffer width in orientation 0
-	static const int LY = 320;            // framebuffer height in orientation 0
-	static const int MAX_WRITE_LINE = 120; // max number of lines to be written in a single operation.
+	static const int LX = ILI9341_T4_DIFF_LX;           // framebuffer width in orientation 0
+	static const int LY = ILI9341_T4_DIFF_LY;           // framebuffer height in orientation 0
+	static const int SCALE_X = ILI9341_T4_DIFF_SCALE_X; // panel pixels per framebuffer pixel, horizontally
+	static const int SCALE_Y = ILI9341_T4_DIFF_SCALE_Y; // panel pixels per framebuffer pixel, vertically
+	static const int PANEL_LX = LX * SCALE_X;           // panel width in orientation 0
+	static const int PANEL_LY = LY * SCALE_Y;           // panel height (number of scanlines) in orientation 0
+	static const int MAX_WRITE_LINE = LY / 2; // max number of lines to be written in a single operation.
 	static const int MIN_SCANLINE_SPACE = 8; // min number of lines between the current write line and the current scanline
 
 	static_assert((LX & 3) == 0, "LX must be divisible by 4");
+	static_assert((SCALE_X >= 1) && (SCALE_Y >= 1), "scale factors must be positive");
+
+	/**
+	 * Diffs are computed and stored in framebuffer coordinates: x in [0, LX-1], y in [0, LY-1].
+	 * These return the panel coordinates of the top left panel pixel covering a framebuffer pixel
+	 * (the framebuffer pixel (x,y) covers SCALE_X x SCALE_Y panel pixels).
+	 **/
+	static int panelX(int x) {
+		return x * SCALE_X;
+	}
+
+	static int panelY(int y) {
+		return y * SCALE_Y;
+	}
+
+	/** framebuffer row displayed on a given scanline (scanlines past the end give LY) */
+	static int scanlineRow(int scanline) {
+		return (scanline >= PANEL_LY) ? LY : (scanline / SCALE_Y);
+	}
 
 	/**
 	 * Compute the diff between two framebuffers. Any previous diff is overwritten.
@@ -157,13 +198,15 @@ public:
 
 	/**
 	 * Read the next instruction in the diff.
-	 * - 'x','y' and 'len' are used to store the next instruction.
-	 * - 'scanline' must contain the current position of the scanline
+	 * - 'x','y' and 'len' are used to store the next instruction, in framebuffer coordinates
+	 *   (use panelX() / panelY() to place it on the panel, each pixel is then sent SCALE_X times).
+	 * - 'scanline' must contain the current position of the scanline, in panel rows
+	 *   (PANEL_LY or more if the scanline should not be waited for).
 	 *
 	 * returns 0 :  in this case  x, y to contain the start position and
 	 *              len contains the number of pixels to write.
 	 *
-	 * returns a>0 : must wait until scanline reaches 'a' then call the
+	 * returns a>0 : must wait until scanline (in panel rows) reaches 'a' then call the
 	 *               method again to get the instructions.
 	 *               (x,y) are set to the same value that the next read
 	 *               will return when timing is right but len is set to 0
@@ -193,6 +236,57 @@ public:
 	static void rotationBox(int orientation, int xmin, int xmax, int ymin,
 			int ymax, int &x1, int &x2, int &y1, int &y2);
 
+	/**
+	 * Inverse of rotationBox(): transform the box (x1,x2,y1,y2) given w.r.t. orientation 0 and
+	 * fill (xmin,xmax,ymin,ymax) with its coord. according to orientation 'orientation'.
+	 **/
+	static void inverseRotationBox(int orientation, int x1, int x2, int y1,
+			int y2, int &xmin, int &xmax, int &ymin, int &ymax);
+
+	/**
+	 * Return true if computeDiff() compares against the old framebuffer (fb_old). Otherwise the diff
+	 * keeps its own record of what was uploaded and fb_old may be nullptr (see DiffBuffSig).
+	 **/
+	virtual bool requiresOldFramebuffer() const {
+		return true;
+	}
+
+	/**
+	 * Return true if the diff is made of rectangles that should be read with readRect() (readDiff()
+	 * still works but returns them one line at a time).
+	 **/
+	virtual bool rectangles() const {
+		return false;
+	}
+
+	/**
+	 * Read the next rectangle [x, x + w - 1] x [y, y + h - 1] of the diff (framebuffer coordinates,
+	 * orientation 0). Only for diffs whose rectangles() method returns true.
+	 *
+	 * Same return values as readDiff(): 0 when (x,y,w,h) holds a rectangle to write (a rectangle
+	 * too close to the scanline is returned in several parts, one below the other), a>0 to wait
+	 * for the scanline to reach 'a' (then h = 0) and a<0 when done.
+	 **/
+	virtual int readRect(int & /*x*/, int & /*y*/, int & /*w*/, int & /*h*/,
+			int /*scanline*/) {
+		return -1;
+	}
+
+	/**
+	 * Return the number of bytes used by the last diff (0 for diffs that do not store instructions).
+	 **/
+	virtual int size() const {
+		return 0;
+	}
+
+	/**
+	 * Return true if the last diff ran out of memory: its end was then replaced by a full redraw
+	 * (TAG_WRITE_ALL) of the remaining pixels. Used by the driver statistics (see printStats()).
+	 **/
+	virtual bool overflowed() const {
+		return false;
+	}
+
 private:
 
 	// copy and rotate a framebuffer
@@ -241,7 +335,7 @@ public:
 	 **/
 	DiffBuff(uint8_t *buffer, size_t sizebuf) :
 			DiffBuffBase(), _tab(buffer), _sizebuf(sizebuf - PADDING), _posw(0), _posr(
-					0), _posraw(0) {
+					0), _posraw(0), _overflow(false) {
 		_write_encoded(TAG_END);
 		initRead();
 		initRaw();
@@ -287,13 +381,17 @@ public:
 	 * Return the current size of the diff.
 	 * (return the total size of the buffer in case of overflow).
 	 **/
-	int size() const {
+	virtual int size() const override {
 		return ((_posw >= _sizebuf) ? (_sizebuf + PADDING) : _posw);
 	}
 
+	virtual bool overflowed() const override {
+		return _overflow;
+	}
+
 	static const int MIN_BUFFER_SIZE = 16;             // minimum buffer size
 
-private:
+protected:
 
 	static const int PADDING = 8; // reserved at end of buffer (in case of overflow)
 	static const uint32_t TAG_END = (0x400000 - 1);        // tag at end of diff
@@ -305,6 +403,7 @@ private:
 	int _posw;                    // current position in the array (for writing)
 	int _posr;                    // current position in the array (for reading)
 	int _posraw;                // current position in the array for raw reading
+	bool _overflow;             // true if the last diff ran out of memory (see _write_chunk()).
 
 	int _r_x, _r_y, _r_len;             // current instruction (for reading)
 	bool _r_cont; // true is (_r_x, _r_y_, _r_len) contain a valid instruction (for reading).
@@ -356,6 +455,7 @@ private:
 	bool _write_chunk(uint32_t nbwrite, uint32_t nbskip) {
 		if (_posw >= _sizebuf) { // running out of memory buffer
 			_write_encoded(TAG_WRITE_ALL);
+			_overflow = true;
 			return false;
 		}
 		_write_encoded(nbwrite); // write remaining
@@ -368,7 +468,7 @@ private:
 	void _computeDiff(uint16_t *fb_old, const uint16_t *fb_new,
 			int fb_new_orientation, int gap, uint16_t compare_mask);
 
-	/** called when the src framebuffer is in orientation 0 */
+	/** called when the src framebuffer is in orientation 0 (2 pixels per word when both are word aligned) */
 	template<bool COPY_NEW_OVER_OLD, bool USE_MASK>
 	void _computeDiff0(uint16_t *fb_old, const uint16_t *fb_new, int gap,
 			uint16_t compare_mask);
@@ -421,6 +521,251 @@ private:
 
 };
 
+/******************************************************************************************
+ * Class used to compute a diff from row signatures, without keeping the old framebuffer.
+ *
+ * Each row of the framebuffer (in orientation 0) is cut in nbseg segments and only a 32 bit
+ * signature of each segment (CRC or hash of its pixels) is kept from one diff to the next. The
+ * diff redraws every segment whose signature changed. A mirror framebuffer (fb_old, 75KB) is
+ * therefore not needed: the signatures take LY * nbseg * 4 bytes (960 bytes for one segment per
+ * row) plus the buffer holding the diff itself (a few hundred bytes).
+ *
+ * - fb_old is ignored and may be nullptr. With copy_new_over_old = false, the signatures are
+ *   not updated.
+ * - the new framebuffer must be in orientation 0 and word aligned, otherwise the diff redraws
+ *   everything.
+ * - the partial computeDiff() does not compare anything: it forgets the signatures of the rows
+ *   covered by the region (which has been drawn by other means) and returns an empty diff so that
+ *   they are redrawn by the next diff.
+ * - a segment whose pixels change but keep the same signature is not redrawn: with 32 bit
+ *   signatures, this happens with probability around 2^-32 per changed segment.
+ *******************************************************************************************/
+class DiffBuffSig: public DiffBuff {
+
+public:
+
+	/**
+	 * Constructor. sig must hold LY * nbseg signatures and buffer holds the diff (see DiffBuff). 
+	 * nbseg must divide LX/2 (it is set to 1 otherwise). 
+	 **/
+	DiffBuffSig(uint32_t *sig, int nbseg, uint8_t *buffer, size_t sizebuf);
+
+	virtual void computeDiff(uint16_t *fb_old, const uint16_t *fb_new,
+			int fb_new_orientation, int gap, bool copy_new_over_old,
+			uint16_t compare_mask) override;
+
+	virtual void computeDiff(uint16_t *fb_old, DiffBuffBase *diff_old,
+			const uint16_t *sub_fb_new, int xmin, int xmax, int ymin, int ymax,
+			int stride, int fb_new_orientation, int gap, bool copy_new_over_old,
+			uint16_t compare_mask) override;
+
+	virtual bool requiresOldFramebuffer() const override {
+		return false;
+	}
+
+	/** forget every signature: the next diff redraws everything */
+	void invalidate();
+
+private:
+
+	static const uint32_t SIG_INVALID = 0xFFFFFFFF; // never returned by _signature()
+
+	uint32_t *const _sig;   // one signature per segment
+	int _nbseg;             // number of segments per row
+
+	/** signature of nbwords words */
+	static uint32_t _signature(const uint32_t *p, int nbwords, uint32_t mask32);
+
+};
+
+/******************************************************************************************
+ * Diff from row signatures with statically allocated memory: NBSEG segments per row and a
+ * diff buffer of SIZEBUF bytes.
+ *******************************************************************************************/
+template<int NBSEG = 1, int SIZEBUF = 512>
+class DiffBuffSigStatic: public DiffBuffSig {
+
+	static_assert(SIZEBUF >= MIN_BUFFER_SIZE, "template parameter SIZEBUF too small !");
+	static_assert(((DiffBuffBase::LX / 2) % NBSEG) == 0, "NBSEG must divide LX/2 !");
+
+public:
+
+	DiffBuffSigStatic() :
+			DiffBuffSig(_staticsig, NBSEG, _statictab, SIZEBUF) {
+	}
+
+private:
+
+	uint32_t _staticsig[DiffBuffBase::LY * NBSEG];
+	uint8_t _statictab[SIZEBUF];
+
+};
+
+/******************************************************************************************
+ * Diff made of rectangles (CASET/PASET windows) instead of [write, skip] runs.
+ *
+ * DiffBuff needs one instruction per line for a change spanning several lines (e.g. a moving
+ * sprite) and each one pays for setting the window. Here, the changed runs of each line are
+ * merged into rectangles growing downwards, and a rectangle is uploaded with a single window.
+ *
+ * Whether a run joins a rectangle (resending the unchanged pixels that merging adds) or opens
+ * a new one is decided by a cost model: the upload of a rectangle of w x h pixels costs
+ * window_cost + w * h * pixel_cost. The defaults count FSMC write cycles, which have the same
+ * duration for commands and data: a (doubled) framebuffer pixel is a 32 bit write, i.e. 2 cycles,
+ * and a window takes 11 (CASET + 4, PASET + 4, RAMWR). Change them with setCostModel() if the
+ * bus timings or the pixel scaling differ.
+ *
+ * - the gap parameter still breaks the changed pixels of a line in runs. It is only a pre-grouping:
+ *   the cost model decides how the runs end up in the rectangles.
+ * - rectangles are listed in order of their last line so that the scanline can be followed.
+ * - when the rectangle array is full, new rectangles are merged with the last one (the diff stays
+ *   valid but redraws more).
+ * - readRaw() (used when another diff merges this one) only describes the band of lines covered
+ *   by the rectangles.
+ *******************************************************************************************/
+class DiffBuffRect: public DiffBuffBase {
+
+public:
+
+	/** a rectangle of the diff (framebuffer coordinates, orientation 0) */
+	struct Rect {
+		uint16_t x, y, w, h;
+	};
+
+	static const int DEFAULT_PIXEL_COST = 2;   // FSMC write cycles per framebuffer pixel.
+	static const int DEFAULT_WINDOW_COST = 11; // FSMC write cycles to set a window.
+	static const int MAX_OPEN = 16;            // max number of rectangles growing at the same time.
+	static const int MIN_RECTS = 4;            // min size of the rectangle array.
+
+	/**
+	 * Constructor. rects is the array holding the diff, with room for maxrects rectangles
+	 * (8 bytes each). maxrects must be at least MIN_RECTS (asserted).
+	 **/
+	DiffBuffRect(Rect *rects, int maxrects);
+
+	/**
+	 * Set the cost model: costs of sending a framebuffer pixel and of setting a window, in any
+	 * (common) unit. Values smaller than 1 are set to 1.
+	 **/
+	void setCostModel(int pixel_cost = DEFAULT_PIXEL_COST, int window_cost =
+			DEFAULT_WINDOW_COST);
+
+	int pixelCost() const {
+		return _pixel_cost;
+	}
+
+	int windowCost() const {
+		return _window_cost;
+	}
+
+	/** empty the diff (before building it with addRect()) */
+	void clear();
+
+	/**
+	 * Add the box [xmin,xmax]x[ymin,ymax] of a framebuffer in orientation fb_orientation to the
+	 * diff (damage tracking, see ILI9341Wrapper::setDamage()). No framebuffer is compared: the
+	 * box is clipped and merged with the rectangles that are cheaper to send together with it
+	 * (cost model), cheapest first. When the array is full, it is merged with the rectangle that
+	 * costs the least to grow and overflowed() becomes true until the next clear().
+	 **/
+	void addRect(int xmin, int xmax, int ymin, int ymax, int fb_orientation = 0);
+
+	virtual void computeDiff(uint16_t *fb_old, const uint16_t *fb_new,
+			int fb_new_orientation, int gap, bool copy_new_over_old,
+			uint16_t compare_mask) override;
+
+	virtual void computeDiff(uint16_t *fb_old, DiffBuffBase *diff_old,
+			const uint16_t *sub_fb_new, int xmin, int xmax, int ymin, int ymax,
+			int stride, int fb_new_orientation, int gap, bool copy_new_over_old,
+			uint16_t compare_mask) override;
+
+	virtual void initRead() override;
+
+	virtual int readDiff(int &x, int &y, int &len, int scanline) override;
+
+	virtual void initRaw() override;
+
+	virtual void readRaw(int &nbwrite, int &nbskip) override;
+
+	virtual bool rectangles() const override {
+		return true;
+	}
+
+	virtual int readRect(int &x, int &y, int &w, int &h, int scanline)
+			override;
+
+	/** number of rectangles in the diff */
+	int nbRects() const {
+		return _nbrects;
+	}
+
+	/** size of the diff in bytes */
+	virtual int size() const override {
+		return _nbrects * (int) sizeof(Rect);
+	}
+
+	virtual bool overflowed() const override {
+		return _overflow;
+	}
+
+private:
+
+	Rect *const _rects;     // the diff
+	const int _maxrects;    // and its capacity
+	int _nbrects;           // number of rectangles in the diff
+	bool _overflow;         // true if rectangles had to be merged for lack of room
+
+	int _pixel_cost;        // cost model
+	int _window_cost;
+
+	Rect _open[MAX_OPEN];   // rectangles still growing (while computing)
+	int _nbopen;
+
+	int _r_i;                           // next rectangle (for reading)
+	int _r_x, _r_y, _r_w, _r_h;         // part of the current rectangle not read yet
+	int _d_x, _d_y, _d_w, _d_h;         // lines of the current part not read yet (readDiff())
+	int _raw;                           // position for raw reading (0, 1, 2)
+	int _raw_y1, _raw_y2;               // band of lines covered by the diff
+
+	/** compare the box [x1,x2]x[y1,y2] (orientation 0) and add the rectangles */
+	void _compare(uint16_t *fb_old, const uint16_t *sub_fb_new, int x1,
+			int x2, int y1, int y2, int stride, int fb_new_orientation,
+			int gap, bool copy_new_over_old, uint16_t compare_mask);
+
+	/** add the run [a,b] of line y to the cheapest growing rectangle or to a new one */
+	void _addRun(int y, int a, int b);
+
+	/** move the growing rectangles that did not reach line y to the diff */
+	void _closeRects(int y);
+
+	/** append a rectangle to the diff (merged with the last one if there is no room) */
+	void _emit(int x, int y, int w, int h);
+
+	/** extra cost of sending a and b as a single rectangle instead of two (negative = cheaper) */
+	int _mergeCost(const Rect &a, const Rect &b) const;
+
+};
+
+/******************************************************************************************
+ * Rectangle diff with statically allocated memory for MAXRECTS rectangles.
+ *******************************************************************************************/
+template<int MAXRECTS = 64>
+class DiffBuffRectStatic: public DiffBuffRect {
+
+	static_assert(MAXRECTS >= MIN_RECTS, "template parameter MAXRECTS too small !");
+
+public:
+
+	DiffBuffRectStatic() :
+			DiffBuffRect(_staticrects, MAXRECTS) {
+	}
+
+private:
+
+	Rect _staticrects[MAXRECTS];
+
+};
+
 /******************************************************************************************
  * Class used to compute a "dummy" diff between 2 framebuffers.
  *
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstdint>
+
+/**
+ * Compact command buffer holding the draw calls of a frame, recorded by an
+ * ILI9341Wrapper (see ILI9341WrapperT::setRecord()) and replayed later with
+ * ILI9341WrapperT::replay(), e.g. once per band (see BandRenderer).
+ *
+ * Each command is a few 16 bit words: an opcode, the range of lines it
+ * touches (so that a band skips the commands outside it without decoding
+ * them) and the arguments of the primitive. A filled triangle takes 10 words.
+ *
+ * When the buffer is full, further commands are dropped and overflowed()
+ * returns true until the next clear().
+ **/
+class DisplayList {
+
+public:
+
+	enum {
+		OP_PIXEL, OP_HLINE, OP_VLINE, OP_FILLRECT, OP_RECT, OP_LINE, OP_TRIANGLE, OP_CIRCLE
+	};
+
+	static const int OP_OUTLINE = 0x100;  // flags of OP_CIRCLE
+	static const int OP_FILL = 0x200;     //
+	static const int OP_MASK = 0xFF;
+
+	static const int MAX_ARGS = 7;
+
+	/** buf holds size words (2 bytes each) */
+	DisplayList(int16_t *buf, int size) :
+			_buf(buf), _size(size) {
+		clear();
+	}
+
+	/** forget all the commands */
+	void clear() {
+		_len = 0;
+		_nbcmds = 0;
+		_overflow = false;
+	}
+
+	/** append a command touching lines [ymin, ymax] (returns false if dropped) */
+	bool push(int op, int ymin, int ymax, const int *args, int nbargs) {
+		if (_len + 3 + nbargs > _size) {
+			_overflow = true;
+			return false;
+		}
+		_buf[_len++] = (int16_t) op;
+		_buf[_len++] = (int16_t) _clamp(ymin);
+		_buf[_len++] = (int16_t) _clamp(ymax);
+		for (int i = 0; i < nbargs; i++)
+			_buf[_len++] = (int16_t) args[i];
+		_nbcmds++;
+		return true;
+	}
+
+	/** number of words of the command buffer in use */
+	int size() const {
+		return _len;
+	}
+
+	/** number of commands recorded */
+	int nbCommands() const {
+		return _nbcmds;
+	}
+
+	bool overflowed() const {
+		return _overflow;
+	}
+
+	const int16_t* data() const {
+		return _buf;
+	}
+
+	/** number of arguments of an opcode */
+	static int nbArgs(int op) {
+		switch (op & OP_MASK) {
+		case OP_PIXEL:
+			return 3;
+		case OP_HLINE:
+		case OP_VLINE:
+			return 4;
+		case OP_FILLRECT:
+		case OP_RECT:
+		case OP_LINE:
+		case OP_CIRCLE:
+			return 5;
+		default: // OP_TRIANGLE
+			return 7;
+		}
+	}
+
+private:
+
+	static int _clamp(int v) {
+		return (v < -32768) ? -32768 : ((v > 32767) ? 32767 : v);
+	}
+
+	int16_t *const _buf;
+	const int _size;
+	int _len;       // words in use
+	int _nbcmds;
+	bool _overflow;
+
+};
+
+/** display list with statically allocated memory for SIZE words */
+template<int SIZE = 2048> class DisplayListStatic: public DisplayList {
+
+public:
+
+	DisplayListStatic() :
+			DisplayList(_staticbuf, SIZE) {
+	}
+
+private:
+
+	int16_t _staticbuf[SIZE];
+
+};
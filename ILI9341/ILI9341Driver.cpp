@@ -23,12 +23,83 @@
 #include "font_ILI9341_T4.h"
 #include <cstring>
 
-extern "C" {
-#include "ili9341.h"
-}
-
 namespace ILI9341_T4 {
 
+static_assert((DiffBuffBase::LX == ILI9341_FB_PIXEL_WIDTH) && (DiffBuffBase::LY == ILI9341_FB_PIXEL_HEIGHT),
+		"diff buffers must have the framebuffer dimensions");
+static_assert((DiffBuffBase::PANEL_LX == ILI9341_PHY_PIXEL_WIDTH) && (DiffBuffBase::PANEL_LY == ILI9341_PHY_PIXEL_HEIGHT),
+		"diff scale factors must map the framebuffer onto the panel");
+static_assert((DiffBuffBase::SCALE_X == 2) && (DiffBuffBase::SCALE_Y == 1),
+		"the upload routines (_pushpixels_x2, _dmaNextLine) only double pixels horizontally");
+static_assert(DiffBuffBase::PANEL_LY == ILI9341_T4_NB_SCANLINES, "scanlines must map to the panel rows");
+
+ILI9341Driver *ILI9341Driver::_dmaObject = nullptr;
+
+ILI9341Driver::ILI9341Driver() {
+	_rotation = 0;
+	_refreshmode = 11; // as set by lcdInit() (RTNA = 0x1B, around 70Hz).
+	_irq_priority = ILI9341_T4_DEFAULT_IRQ_PRIORITY;
+	_diff_gap = ILI9341_T4_DEFAULT_DIFF_GAP;
+	_vsync_spacing = ILI9341_T4_DEFAULT_VSYNC_SPACING;
+	_late_start_ratio = ILI9341_T4_DEFAULT_LATE_START_RATIO;
+	_late_start_ratio_override = true;
+	_compare_mask = 0;
+	_auto_gap = false;
+	_auto_gap_dir = -1;
+	_auto_gap_frames = 0;
+	_auto_gap_overflows = 0;
+	_auto_gap_cost = 0.0f;
+	_auto_gap_prev = -1.0f;
+	_interlace = false;
+	_interlace_auto = true;
+	_interlace_field = 0;
+	_interlace_changed = ILI9341_T4_NB_PIXELS;
+	_field = -1;
+	statsReset();
+	_htim = nullptr;
+	_te_port = nullptr;
+	_te_pin = 0;
+	_period = 0;
+	_synced_time = 0;
+	_synced_scanline = 0;
+	_timeframestart = 0;
+	_diff1 = nullptr;
+	_fb1 = nullptr;
+	_fb1_valid = false;
+	_diff2 = nullptr;
+	_pending = nullptr;
+	_pending_begin = 0;
+	_pending_end = 0;
+	_hdma = nullptr;
+	_dma_fb = nullptr;
+	_dma_line = 0;
+	_dma_busy = false;
+	_dma_linelen = ILI9341_FB_PIXEL_WIDTH;
+	_upload_cb = nullptr;
+	_upload_cb_param = nullptr;
+	_dma_nblines = 0;
+	_dma_word = true;
+	_dma_rows = false;
+	_palette = nullptr;
+	_dma_fb8 = nullptr;
+	_dma_srclen = 0;
+	_dma_rowshift = 0;
+	_dma_double = false;
+	_dma_fbs = nullptr;
+	_dma_sx = 1;
+	_dma_diff = nullptr;
+	_dma_cur = 0;
+	_dma_rx = _dma_rw = _dma_cx = _dma_cy = _dma_left = 0;
+	_dma_t0 = 0;
+	_dma_pixels = _dma_runs = 0;
+	_scroll_start = 0;
+	_scroll_end = 0;
+	_scroll_offset = 0;
+	_hw_rotation = false;
+	setRotation(0);
+	_hw_rotation = true; // MADCTL is written by the next setRotation(): the panel may not be initialized yet.
+}
+
 /**********************************************************************************************************
  * Screen orientation
  ***********************************************************************************************************/
@@ -37,6 +108,7 @@ void ILI9341Driver::setRotation(uint8_t m) {
 	m = _clip(m, (uint8_t) 0, (uint8_t) 3);
 //	if (m == _rotation)
 //		return;
+	waitUploadDone(); // the dma may still be streaming with the previous addressing.
 
 	_rotation = m;
 	switch (m) {
@@ -51,15 +123,349 @@ void ILI9341Driver::setRotation(uint8_t m) {
 		_height = ILI9341_FB_PIXEL_WIDTH;
 		break;
 	}
+	if (_hw_rotation) {
+		// the panel is mounted in landscape: these MADCTL settings make the framebuffer rows run
+		// along the address counter for each orientation (see lcdInit() for the bits).
+		static const lcdOrientationTypeDef orientations[4] = {
+				LCD_ORIENTATION_LANDSCAPE, LCD_ORIENTATION_PORTRAIT_MIRROR,
+				LCD_ORIENTATION_LANDSCAPE_MIRROR, LCD_ORIENTATION_PORTRAIT };
+		lcdSetOrientation(orientations[m]);
+		_fb1_valid = false; // the mirror is kept in the user orientation.
+		_pending = nullptr;
+		_scroll_offset = 0; // the scroll axis may have changed direction.
+		_applyScroll();
+	}
+}
+
+void ILI9341Driver::setHardwareRotation(bool enable) {
+	waitUploadDone();
+	_hw_rotation = enable;
+	_fb1_valid = false;
+	_pending = nullptr;
+	if (enable)
+		setRotation(_rotation);
+	else {
+		lcdSetOrientation(LCD_ORIENTATION_LANDSCAPE); // the addressing the software path expects.
+		_scroll_offset = 0;
+		_applyScroll();
+	}
+}
+
+/**********************************************************************************************************
+ * Scrolling
+ ***********************************************************************************************************/
+
+void ILI9341Driver::setScrollArea(int fixed_start, int fixed_end) {
+	fixed_start = _clip(fixed_start, 0, scrollLength() - 1);
+	fixed_end = _clip(fixed_end, 0, scrollLength() - 1 - fixed_start); // at least one scrolling line.
+	waitUploadDone();
+	_scroll_start = fixed_start;
+	_scroll_end = fixed_end;
+	_scroll_offset = 0;
+	if (_scrollOn())
+		_applyScroll();
+}
+
+void ILI9341Driver::setScroll(int offset) {
+	if (!_scrollOn())
+		return;
+	const int l = scrollLength() - _scroll_start - _scroll_end;
+	offset %= l;
+	if (offset < 0)
+		offset += l;
+	waitUploadDone();
+	_scroll_offset = offset;
+	_applyScroll();
+}
+
+int ILI9341Driver::scrollLine(int pos) const {
+	const int l = scrollLength() - _scroll_start - _scroll_end;
+	return _scroll_start + ((pos + _scroll_offset) % l);
+}
+
+void ILI9341Driver::scroll(uint16_t *fb, int delta, uint16_t color) {
+	if ((!_scrollOn()) || (delta == 0))
+		return;
+	const int l = scrollLength() - _scroll_start - _scroll_end;
+	int n = (delta < 0) ? -delta : delta;
+	if (n > l)
+		n = l;
+	setScroll(_scroll_offset + delta);
+	for (int k = 0; k < n; k++) {
+		const int line = scrollLine((delta > 0) ? (l - n + k) : k);
+		if (fb)
+			_fillScrollLine(fb, line, color);
+		if ((_fb1) && (_fb1_valid) && (!_sigDiff()))
+			_fillScrollLine(_fb1, line, color); // pending diffs now redraw the cleared line.
+		if (_rotation & 1) {
+			_pushRect(color, 0, _width - 1, line, line);
+			if ((_sigDiff()) && (_fb1_valid))
+				_sigForget(0, _width - 1, line, line);
+		} else {
+			_pushRect(color, line, line, 0, _height - 1);
+			if ((_sigDiff()) && (_fb1_valid))
+				_sigForget(line, line, 0, _height - 1);
+		}
+	}
+}
+
+void ILI9341Driver::_applyScroll() {
+	// the panel counts in gate lines (2 per framebuffer line), from the start of its memory.
+	const int l = scrollLength() - _scroll_start - _scroll_end;
+	const bool rev = _scrollReversed();
+	const int tfa = 2 * ((rev) ? _scroll_end : _scroll_start);
+	const int bfa = 2 * ((rev) ? _scroll_start : _scroll_end);
+	const int offset = (rev) ? ((l - _scroll_offset) % l) : _scroll_offset;
+	lcdSetScrollArea(tfa, bfa);
+	lcdSetScrollStart(tfa + 2 * offset);
+}
+
+void ILI9341Driver::_fillScrollLine(uint16_t *fb, int l, uint16_t color) {
+	if (_rotation & 1) { // rows
+		for (int x = 0; x < _width; x++)
+			fb[x + l * _width] = color;
+	} else { // columns
+		for (int y = 0; y < _height; y++)
+			fb[l + y * _width] = color;
+	}
+}
+
+/**********************************************************************************************************
+ * Refresh rate and vsync
+ ***********************************************************************************************************/
+
+void ILI9341Driver::setRefreshMode(int mode) {
+	mode = _clip(mode, 0, 31);
+	waitUploadDone();
+	LCD_CmdWrite(ILI9341_FRAMECONTROLNORMAL);
+	LCD_DataWrite((mode < 16) ? 0x00 : 0x01); // DIVA: fosc or fosc/2
+	LCD_DataWrite(0x10 + (mode & 15));        // RTNA: 16 to 31 clocks per line
+	_refreshmode = mode;
+	_sampleRefreshRate();
+	statsReset();
+}
+
+void ILI9341Driver::setVSyncTimer(TIM_HandleTypeDef *htim) {
+	waitUploadDone();
+	_htim = htim;
+	_sampleRefreshRate();
+}
+
+void ILI9341Driver::setTearingPin(GPIO_TypeDef *port, uint16_t pin) {
+	waitUploadDone();
+	_te_port = port;
+	_te_pin = pin;
+	if (_te_port)
+		lcdTearingOn(false); // V-blank only
+	else
+		lcdTearingOff();
+	_sampleRefreshRate();
+}
+
+void ILI9341Driver::setVSyncSpacing(int vsync_spacing) {
+	_vsync_spacing = _clip(vsync_spacing, 0, ILI9341_T4_MAX_VSYNC_SPACING);
+	_late_start_ratio_override = true;
+}
+
+void ILI9341Driver::setLateStartRatio(float ratio) {
+	_late_start_ratio = _clip(ratio, 0.0f, 1.0f);
+}
+
+int ILI9341Driver::_getScanLine() {
+	const uint32_t now = _micros();
+	if (_te_port) { // no readback: extrapolate from the last V-blank.
+		if (_period == 0)
+			return 0;
+		return (int) ((((now - _synced_time) % _period)
+				* ILI9341_T4_NB_SCANLINES) / _period);
+	}
+	int sl = (lcdGetScanline() * ILI9341_T4_NB_SCANLINES)
+			/ ILI9341_T4_HW_SCANLINES;
+	if (sl >= ILI9341_T4_NB_SCANLINES)
+		sl = ILI9341_T4_NB_SCANLINES - 1; // porch lines.
+	_synced_time = now;
+	_synced_scanline = sl;
+	return sl;
+}
+
+int ILI9341Driver::_waitScanlineWrap() {
+	const uint32_t start = _micros();
+	if (_te_port) {
+		// TE is high during V-blank: wait for the next rising edge.
+		while (HAL_GPIO_ReadPin(_te_port, _te_pin) == GPIO_PIN_SET) {
+			if (_micros() - start > ILI9341_T4_SYNC_TIMEOUT)
+				return -1;
+		}
+		while (HAL_GPIO_ReadPin(_te_port, _te_pin) == GPIO_PIN_RESET) {
+			if (_micros() - start > ILI9341_T4_SYNC_TIMEOUT)
+				return -1;
+		}
+		_synced_time = _micros();
+		_synced_scanline = 0;
+		return 0;
+	}
+	int prev = _getScanLine();
+	while (1) {
+		const int sl = _getScanLine();
+		if (sl < prev)
+			return sl;
+		prev = sl;
+		if (_micros() - start > ILI9341_T4_SYNC_TIMEOUT)
+			return -1;
+	}
+}
+
+void ILI9341Driver::_sampleRefreshRate() {
+	_period = 0;
+	if (_htim == nullptr)
+		return;
+	if (_waitScanlineWrap() < 0)
+		return; // panel not answering: vsync stays off.
+	const uint32_t t0 = _micros();
+	for (int i = 0; i < ILI9341_T4_REFRESH_SAMPLES; i++) {
+		if (_waitScanlineWrap() < 0)
+			return;
+	}
+	const uint32_t t1 = _micros();
+	_period = (t1 - t0) / ILI9341_T4_REFRESH_SAMPLES;
+	_timeframestart = t1;
+	_late_start_ratio_override = true;
+}
+
+int ILI9341Driver::_waitFrameStart(bool chase) {
+	if (!_late_start_ratio_override) {
+		// the refresh this frame is due for starts _vsync_spacing periods after the previous one.
+		const uint32_t due = _timeframestart + _vsync_spacing * _period;
+		if (!chase) {
+			// nothing to chase: spin until just before that refresh and catch its start below.
+			const uint32_t early = due - _period / 4;
+			while ((int32_t) (_micros() - early) < 0) {
+			}
+		} else {
+			while ((int32_t) (_micros() - due) < 0) {
+			}
+			const int sl = _getScanLine();
+			if (sl <= (int) (_late_start_ratio * ILI9341_T4_NB_SCANLINES)) {
+				// that refresh (or a later one) started recently enough: go now and chase the scanline.
+				_timeframestart = _micros()
+						- ((sl * _period) / ILI9341_T4_NB_SCANLINES);
+				return sl;
+			}
+		}
+	}
+	_late_start_ratio_override = false;
+	const int sl = _waitScanlineWrap();
+	if (sl < 0) {
+		_period = 0; // lost the panel: vsync off until the rate is sampled again.
+		return ILI9341_T4_NB_SCANLINES;
+	}
+	_timeframestart = _micros() - ((sl * _period) / ILI9341_T4_NB_SCANLINES);
+	return sl;
 }
 
 /**********************************************************************************************************
  * Differential updates
  ***********************************************************************************************************/
 
+void ILI9341Driver::setFramebuffer(uint16_t *fb1) {
+	waitUploadDone(); // the dma may still be reading the previous one.
+	_fb1 = fb1;
+	_fb1_valid = false;
+	_pending = nullptr;
+}
+
+void ILI9341Driver::setDiffBuffers(DiffBuffBase *diff1, DiffBuffBase *diff2) {
+	waitUploadDone();
+	if (_pending) { // the stored changes may live in a diff we no longer own.
+		_pending = nullptr;
+		_fb1_valid = false;
+	}
+	if ((_sigDiff()) || ((diff1) && (!diff1->requiresOldFramebuffer())))
+		_fb1_valid = false; // the signatures do not describe the screen (nor the mirror).
+	_diff1 = diff1;
+	_diff2 = diff2;
+}
+
+void ILI9341Driver::_sigForget(int xmin, int xmax, int ymin, int ymax) {
+	if (_rowsDoubled()) { // the diff rows are cut from the 240 pixel framebuffer rows.
+		const int y1 = (ymin * ILI9341_FB_PIXEL_HEIGHT) / DiffBuffBase::LX;
+		const int y2 = ((ymax + 1) * ILI9341_FB_PIXEL_HEIGHT - 1)
+				/ DiffBuffBase::LX;
+		_diff1->computeDiff(nullptr, nullptr, nullptr, 0, DiffBuffBase::LX - 1,
+				y1, y2, DiffBuffBase::LX, 0, _diff_gap, false, _compare_mask);
+	} else {
+		_diff1->computeDiff(nullptr, nullptr, nullptr, xmin, xmax, ymin, ymax,
+				_width, _fbOrientation(), _diff_gap, false, _compare_mask);
+	}
+}
+
 void ILI9341Driver::setDiffGap(int gap) {
 	_diff_gap = ILI9341Driver::_clip<int>((int) gap, (int) 2,
 			(int) ILI9341_T4_NB_PIXELS);
+	_auto_gap = false;
+	statsReset();
+}
+
+void ILI9341Driver::setDiffGapAuto(bool enable) {
+	_auto_gap = enable;
+	_auto_gap_dir = -1; // start by trying finer diffs.
+	_auto_gap_frames = 0;
+	_auto_gap_overflows = 0;
+	_auto_gap_cost = 0.0f;
+	_auto_gap_prev = -1.0f;
+	if (enable)
+		_diff_gap = _clip<int>(_diff_gap, ILI9341_T4_AUTO_GAP_MIN,
+				ILI9341_T4_AUTO_GAP_MAX);
+}
+
+void ILI9341Driver::setInterlace(bool enable, bool auto_progressive) {
+	_interlace = enable;
+	_interlace_auto = auto_progressive;
+	_interlace_field = 0;
+	_interlace_changed = ILI9341_T4_NB_PIXELS;
+}
+
+int ILI9341Driver::_nextField(bool diff) {
+	if ((!_interlace) || (_rowsDoubled()))
+		return -1;
+	if ((diff) && (_interlace_auto)
+			&& (_interlace_changed < ILI9341_T4_INTERLACE_STATIC_PIXELS))
+		return -1; // static content: draw it whole.
+	const int field = _interlace_field;
+	_interlace_field ^= 1;
+	return field;
+}
+
+void ILI9341Driver::_copyField(const uint16_t *fb, int field) {
+	for (int y = field; y < DiffBuffBase::LY; y += 2) {
+		int xmin, xmax, ymin, ymax;
+		DiffBuffBase::inverseRotationBox(_fbOrientation(), 0,
+				DiffBuffBase::LX - 1, y, y, xmin, xmax, ymin, ymax);
+		DiffBuffBase::copyfb(_fb1, fb + xmin + _width * ymin, xmin, xmax, ymin,
+				ymax, _width, _fbOrientation());
+	}
+}
+
+void ILI9341Driver::_autoGap(bool overflow) {
+	if (!_auto_gap)
+		return;
+	_auto_gap_cost += _stats_last_pixels
+			+ ILI9341_T4_TRANSACTION_DURATION * _stats_last_runs;
+	if (overflow)
+		_auto_gap_overflows++;
+	if (++_auto_gap_frames < ILI9341_T4_AUTO_GAP_FRAMES)
+		return;
+	const float cost = _auto_gap_cost / _auto_gap_frames;
+	if (_auto_gap_overflows * 8 > _auto_gap_frames)
+		_auto_gap_dir = 1; // the diffs do not fit in the buffers: coarser diffs are smaller.
+	else if ((_auto_gap_prev >= 0.0f) && (cost > _auto_gap_prev))
+		_auto_gap_dir = -_auto_gap_dir; // the last move made things worse: turn back.
+	_auto_gap_prev = cost;
+	_diff_gap = _clip<int>(_diff_gap + _auto_gap_dir * (1 + _diff_gap / 4),
+			ILI9341_T4_AUTO_GAP_MIN, ILI9341_T4_AUTO_GAP_MAX);
+	_auto_gap_frames = 0;
+	_auto_gap_overflows = 0;
+	_auto_gap_cost = 0.0f;
 }
 
 void ILI9341Driver::setDiffCompareMask(uint16_t mask) {
@@ -79,40 +485,1051 @@ void ILI9341Driver::setDiffCompareMask(int bitskip_red, int bitskip_green,
 		_compare_mask = 0;
 }
 
+/**********************************************************************************************************
+ * Statistics
+ ***********************************************************************************************************/
+
+void ILI9341Driver::statsReset() {
+	_stats_nb_frames = 0;
+	_stats_nb_full = 0;
+	_stats_nb_overflow = 0;
+	_stats_uploadtime.reset();
+	_stats_pixels.reset();
+	_stats_runs.reset();
+	_stats_difftime.reset();
+	_stats_diffsize.reset();
+	_stats_last_pixels = 0;
+	_stats_last_runs = 0;
+	_stats_last_time = 0;
+}
+
+void ILI9341Driver::printStats() const {
+	const uint32_t nbdiff = _stats_nb_frames - _stats_nb_full;
+	_print("----------------- ILI9341Driver Stats ----------------\n");
+	_printf("- frames        : %u (%u full redraws)\n",
+			(unsigned) _stats_nb_frames, (unsigned) _stats_nb_full);
+	_print("- upload time   : ");
+	_stats_uploadtime.print("us", "\n", true);
+	_print("- pixels/frame  : ");
+	_stats_pixels.print("", "\n", true);
+	_print("- runs/frame    : ");
+	_stats_runs.print("", "\n", true);
+	_print("- diff time     : ");
+	_stats_difftime.print("us", "\n", true);
+	_print("- diff size     : ");
+	_stats_diffsize.print(" bytes", "\n", true);
+	_printf("- overflows     : %u (%d%% of the diffs)\n",
+			(unsigned) _stats_nb_overflow,
+			(nbdiff > 0) ? (int) ((100 * _stats_nb_overflow) / nbdiff) : 0);
+	_printf("- diff gap      : %d%s\n", _diff_gap,
+			(_auto_gap) ? " (auto)" : "");
+	_print("------------------------------------------------------\n");
+}
+
+void ILI9341Driver::_statsDiff(DiffBuffBase *diff, uint32_t start) {
+	_stats_difftime.push((float) (_micros() - start));
+	_stats_diffsize.push((float) diff->size());
+	if (diff->overflowed())
+		_stats_nb_overflow++;
+}
+
+void ILI9341Driver::_statsFrame(bool full) {
+	_stats_nb_frames++;
+	if (full)
+		_stats_nb_full++;
+	_stats_uploadtime.push((float) _stats_last_time);
+	_stats_pixels.push((float) _stats_last_pixels);
+	_stats_runs.push((float) _stats_last_runs);
+}
+
 /**********************************************************************************************************
  * Update
  ***********************************************************************************************************/
 
+void ILI9341Driver::clear(uint16_t color) {
+	waitUploadDone();
+	_pushRect(color, 0, _width - 1, 0, _height - 1);
+	if ((_fb1) && (!_sigDiff())) {
+		for (int i = 0; i < ILI9341_T4_NB_PIXELS; i++)
+			_fb1[i] = color;
+		_fb1_valid = true;
+	} else if (_sigDiff()) {
+		_fb1_valid = false;
+	}
+	_pending = nullptr;
+}
+
 void ILI9341Driver::updateRegion(bool redrawNow, const uint16_t *fb, int xmin,
 		int xmax, int ymin, int ymax, int stride) {
 	if (fb == nullptr)
 		return;
-	if (stride < 0) {
+	if (stride < 0)
 		stride = xmax - xmin + 1;
+	if (!_clipRegion(fb, xmin, xmax, ymin, ymax, stride))
+		return;
+	waitUploadDone();
 
-		//	_diff1.computeDiff(_fb1, nullptr, fb, xmin, xmax, ymin, ymax, stride, _rotation, _diff_gap, true, _compare_mask);
+	if (_sigDiff()) { // no mirror: draw right away and let the signatures forget the region.
+		_updateRectNow(fb, xmin, xmax, ymin, ymax, stride);
+		if (_fb1_valid)
+			_sigForget(xmin, xmax, ymin, ymax);
+		return;
+	}
+	if ((_fb1 == nullptr) || (!_fb1_valid)) { // nothing mirrors the screen: draw right away.
+		_updateRectNow(fb, xmin, xmax, ymin, ymax, stride);
 		return;
 	}
+
+	if ((_diff1) && (_diff2) && (!_rowsDoubled())) {
+		// merge the changes in the region with the pending ones (held by the other diff buffer).
+		DiffBuffBase *diff = (_pending == _diff1) ? _diff2 : _diff1;
+		diff->computeDiff(_fb1, _pending, fb, xmin, xmax, ymin, ymax, stride,
+				_fbOrientation(), _diff_gap, true, _compare_mask);
+		_pending = diff;
+	} else {
+		int x1, x2, y1, y2; // lines of the mirror, as seen by the diff buffers.
+		if (_rowsDoubled()) { // the mirror has 240 pixel rows, which DiffBuff cannot address.
+			for (int j = ymin; j <= ymax; j++) {
+				memcpy(_fb1 + xmin + j * ILI9341_FB_PIXEL_HEIGHT,
+						fb + (j - ymin) * stride,
+						(xmax - xmin + 1) * sizeof(uint16_t));
+			}
+			y1 = (ymin * ILI9341_FB_PIXEL_HEIGHT) / DiffBuffBase::LX;
+			y2 = ((ymax + 1) * ILI9341_FB_PIXEL_HEIGHT - 1) / DiffBuffBase::LX;
+		} else {
+			DiffBuffBase::copyfb(_fb1, fb, xmin, xmax, ymin, ymax, stride,
+					_fbOrientation());
+			DiffBuffBase::rotationBox(_fbOrientation(), xmin, xmax, ymin, ymax,
+					x1, x2, y1, y2);
+		}
+		if ((redrawNow) && (_pending == nullptr)) { // only this region differs from the screen.
+			_updateRectNow(fb, xmin, xmax, ymin, ymax, stride);
+			return;
+		}
+		// no room for a merged diff: redraw every line touched since the last upload.
+		if (_pending == nullptr) {
+			_pending_begin = y1;
+			_pending_end = y2 + 1;
+		} else {
+			if (y1 < _pending_begin)
+				_pending_begin = y1;
+			if (y2 + 1 > _pending_end)
+				_pending_end = y2 + 1;
+		}
+		_dummydiff.computeDummyDiff(_pending_begin, _pending_end);
+		_pending = &_dummydiff;
+	}
+	if (redrawNow)
+		_flushPending();
+}
+
+void ILI9341Driver::updateDamage(const uint16_t *fb, DiffBuffRect *damage) {
+	if (fb == nullptr)
+		return;
+	if ((damage == nullptr) || (_rowsDoubled())
+			|| (((_fb1) || (_sigDiff())) && (!_fb1_valid))) {
+		update(fb); // the damage cannot be used (or does not tell everything).
+		if (damage)
+			damage->clear();
+		return;
+	}
+	waitUploadDone();
+	_flushPending();
+	const uint32_t t = _micros();
+	if ((_fb1) || (_sigDiff())) {
+		int x, y, w, h;
+		damage->initRead();
+		while (damage->readRect(x, y, w, h, DiffBuffBase::PANEL_LY) == 0) {
+			if (_sigDiff()) {
+				_diff1->computeDiff(nullptr, nullptr, nullptr, x, x + w - 1, y,
+						y + h - 1, DiffBuffBase::LX, 0, _diff_gap, false,
+						_compare_mask);
+			} else {
+				int xmin, xmax, ymin, ymax;
+				DiffBuffBase::inverseRotationBox(_fbOrientation(), x, x + w - 1,
+						y, y + h - 1, xmin, xmax, ymin, ymax);
+				DiffBuffBase::copyfb(_fb1, fb + xmin + _width * ymin, xmin,
+						xmax, ymin, ymax, _width, _fbOrientation());
+			}
+		}
+	}
+	_statsDiff(damage, t);
+	if ((_fb1) && (!_sigDiff()))
+		_updateNow(_fb1, 0, damage); // the mirror is up to date, in orientation 0.
+	else
+		_updateNow(fb, _fbOrientation(), damage);
+	_statsFrame(false);
+	damage->clear();
+}
+
+void ILI9341Driver::_flushPending() {
+	if (_pending == nullptr)
+		return;
+	_updateNow(_fb1, 0, _pending);
+	_pending = nullptr;
+}
+
+bool ILI9341Driver::_clipRegion(const uint16_t *&sub_fb, int &xmin, int &xmax,
+		int &ymin, int &ymax, int stride) const {
+	if (xmin < 0) {
+		sub_fb -= xmin;
+		xmin = 0;
+	}
+	if (ymin < 0) {
+		sub_fb -= ymin * stride;
+		ymin = 0;
+	}
+	if (xmax >= _width)
+		xmax = _width - 1;
+	if (ymax >= _height)
+		ymax = _height - 1;
+	return ((xmin <= xmax) && (ymin <= ymax));
 }
 
 void ILI9341Driver::update(const uint16_t *fb, bool force_full_redraw) {
+	if (fb == nullptr)
+		return;
+	waitUploadDone(); // the bus and the mirror belong to the dma until then.
+
+	if (_sigDiff()) {
+		// no mirror: the diff compares the row signatures of fb with the ones of the last upload.
+		const uint32_t t = _micros();
+		_diff1->computeDiff(nullptr, fb, _fbOrientation(), _diff_gap, true,
+				_compare_mask);
+		if ((_fb1_valid) && (!force_full_redraw)) {
+			_statsDiff(_diff1, t);
+			_updateNow(fb, _fbOrientation(), _diff1);
+			_statsFrame(false);
+			_autoGap(_diff1->overflowed());
+			return;
+		}
+		_fb1_valid = true; // the full redraw below matches the signatures.
+	} else if ((_fb1) && (_diff1) && (_fb1_valid) && (!force_full_redraw)) {
+		// diff against the mirror (bringing it up to date), merged with the changes not drawn yet.
+		DiffBuffBase *diff = _diff1;
+		const int field = _nextField(true);
+		if ((_pending) && ((_rowsDoubled()) || (field >= 0)))
+			_flushPending(); // cannot merge: the mirror rows are not DiffBuff rows, or only a field is copied.
+		const uint32_t t = _micros();
+		if (_pending) {
+			diff = (_pending == _diff1) ? _diff2 : _diff1;
+			diff->computeDiff(_fb1, _pending, fb, 0, _width - 1, 0,
+					_height - 1, _width, _fbOrientation(), _diff_gap, true,
+					_compare_mask);
+			_pending = nullptr;
+		} else {
+			diff->computeDiff(_fb1, fb, _fbOrientation(), _diff_gap,
+					(field < 0), _compare_mask);
+		}
+		_statsDiff(diff, t);
+		if (field >= 0) { // interlaced: the rows of the other field stay in the next diff.
+			_field = field;
+			_updateNow(fb, _fbOrientation(), diff);
+			_field = -1;
+			_copyField(fb, field);
+			_interlace_changed = 2 * _stats_last_pixels;
+		} else {
+			_updateNow(_fb1, 0, diff); // the mirror is in orientation 0: no rotation when pushing.
+			_interlace_changed = _stats_last_pixels;
+		}
+		_statsFrame(false);
+		_autoGap(diff->overflowed());
+		return;
+	}
+
+	const int field = ((_fb1 == nullptr) && (!_sigDiff()) && (!force_full_redraw)) ?
+			_nextField(false) : -1;
+	if (field >= 0) { // interlaced, and nothing to keep up to date.
+		DiffBuffDummy dummydiff;
+		dummydiff.computeDummyDiff();
+		_field = field;
+		_updateNow(fb, _fbOrientation(), &dummydiff);
+		_field = -1;
+	} else if ((_fbOrientation() == 0) && (!_vsyncOn())) {
+		_pushFrameNow(fb);
+	} else {
+		DiffBuffDummy dummydiff;
+		dummydiff.computeDummyDiff();
+		_updateNow(fb, _fbOrientation(), &dummydiff);
+	}
+	_statsFrame(true);
+	if ((_fb1) && (!_sigDiff())) {
+		DiffBuffBase::copyfb(_fb1, fb, _fbOrientation());
+		_fb1_valid = true;
+	}
+	_pending = nullptr;
+}
+
+void ILI9341Driver::_updateNow(const uint16_t *fb, int fb_orientation,
+		DiffBuffBase *diff) {
+	if (diff->rectangles()) {
+		_updateRectsNow(fb, fb_orientation, diff);
+		return;
+	}
+	diff->initRead();
+	// without vsync, or when the diff rows do not follow the gate lines (the scanline then says
+	// nothing about them), pretend the scanline is past the end so the diff never asks us to wait.
+	int scanline = ILI9341_T4_NB_SCANLINES;
+	if (_vsyncOn()) {
+		const int sl = _waitFrameStart(_scanAligned());
+		if (_scanAligned())
+			scanline = sl;
+	}
+	const uint32_t t0 = _micros();
+	uint32_t waited = 0;
+	int pixels = 0, runs = 0, next = -1;
+	int x = 0, y = 0, len = 0;
+	int r;
+	while ((r = diff->readDiff(x, y, len, scanline)) >= 0) {
+		if (r > 0) { // ahead of the scanline: wait for it to move on.
+			const uint32_t tw = _micros();
+			const int sl = _getScanLine();
+			// scanline wrapped: we are late for this refresh so there is no point in waiting anymore.
+			scanline = (sl < scanline) ? ILI9341_T4_NB_SCANLINES : sl;
+			waited += _micros() - tw;
+			continue;
+		}
+		const int off = x + DiffBuffBase::LX * y;
+		if (off != next) // not the continuation of a run split by the scanline.
+			runs++;
+		next = off + len;
+		if (_field >= 0) { // interlaced: the rows of the field only, one window each.
+			while (len > 0) {
+				const int n = (len < DiffBuffBase::LX - x) ? len : (DiffBuffBase::LX - x);
+				if ((y & 1) == _field) {
+					lcdSetWindow(DiffBuffBase::panelX(x), DiffBuffBase::panelY(y),
+							ILI9341_PHY_PIXEL_WIDTH - 1, ILI9341_PHY_PIXEL_HEIGHT - 1);
+					_pushpixels(fb, fb_orientation, x, y, n);
+					pixels += n;
+				}
+				len -= n;
+				x = 0;
+				y++;
+			}
+			continue;
+		}
+		pixels += len;
+		if (_rowsDoubled()) {
+			_pushRun(fb, x + DiffBuffBase::LX * y, len);
+			continue;
+		}
+		// runs never wrap in the middle of a line so the window can always extend to the right edge.
+		lcdSetWindow(DiffBuffBase::panelX(x), DiffBuffBase::panelY(y),
+				ILI9341_PHY_PIXEL_WIDTH - 1, ILI9341_PHY_PIXEL_HEIGHT - 1);
+		_pushpixels(fb, fb_orientation, x, y, len);
+		lcdAdvanceWritePointer(DiffBuffBase::SCALE_X * len); // a run split by the scanline resumes with WRITEMEMCONTINUE.
+	}
+	LCD_CmdWrite(ILI9341_NOP);
+	_stats_last_pixels = pixels;
+	_stats_last_runs = runs;
+	_stats_last_time = _micros() - t0 - waited; // bus time only.
+}
+
+void ILI9341Driver::_updateRectsNow(const uint16_t *fb, int fb_orientation,
+		DiffBuffBase *diff) {
+	diff->initRead();
+	int scanline = ILI9341_T4_NB_SCANLINES; // as in _updateNow().
+	if (_vsyncOn()) {
+		const int sl = _waitFrameStart(_scanAligned());
+		if (_scanAligned())
+			scanline = sl;
+	}
+	const uint32_t t0 = _micros();
+	uint32_t waited = 0;
+	int pixels = 0, runs = 0, next_x = -1, next_y = -1;
+	int x = 0, y = 0, w = 0, h = 0;
+	int r;
+	while ((r = diff->readRect(x, y, w, h, scanline)) >= 0) {
+		if (r > 0) { // ahead of the scanline: wait for it to move on.
+			const uint32_t tw = _micros();
+			const int sl = _getScanLine();
+			scanline = (sl < scanline) ? ILI9341_T4_NB_SCANLINES : sl;
+			waited += _micros() - tw;
+			continue;
+		}
+		if ((x != next_x) || (y != next_y)) // not the next part of a split rectangle.
+			runs++;
+		next_x = x;
+		next_y = y + h;
+		if (_field >= 0) { // interlaced: the rows of the field only, one window each.
+			for (int j = (((y & 1) == _field) ? 0 : 1); j < h; j += 2) {
+				lcdSetWindow(DiffBuffBase::panelX(x), DiffBuffBase::panelY(y + j),
+						DiffBuffBase::panelX(x + w) - 1, ILI9341_PHY_PIXEL_HEIGHT - 1);
+				_pushpixels(fb, fb_orientation, x, y + j, w);
+				pixels += w;
+			}
+			continue;
+		}
+		pixels += w * h;
+		if (_rowsDoubled()) { // the lines of the rectangle are runs of the rotated framebuffer.
+			for (int j = 0; j < h; j++)
+				_pushRun(fb, x + DiffBuffBase::LX * (y + j), w);
+			continue;
+		}
+		// the window extends to the bottom so the next part of a split rectangle just continues it.
+		lcdSetWindow(DiffBuffBase::panelX(x), DiffBuffBase::panelY(y),
+				DiffBuffBase::panelX(x + w) - 1, ILI9341_PHY_PIXEL_HEIGHT - 1);
+		for (int j = 0; j < h; j++)
+			_pushpixels(fb, fb_orientation, x, y + j, w);
+		lcdAdvanceWritePointer(DiffBuffBase::SCALE_X * w * h);
+	}
+	LCD_CmdWrite(ILI9341_NOP);
+	_stats_last_pixels = pixels;
+	_stats_last_runs = runs;
+	_stats_last_time = _micros() - t0 - waited; // bus time only.
+}
+
+void ILI9341Driver::_pushFrameNow(const uint16_t *fb) {
+	const uint32_t t0 = _micros();
+	if (_rowsDoubled()) {
+		lcdSetWindow(0, 0, ILI9341_PHY_PIXEL_HEIGHT - 1,
+				ILI9341_PHY_PIXEL_WIDTH - 1);
+		for (int y = 0; y < ILI9341_FB_PIXEL_WIDTH; y++) {
+			const uint16_t *p = fb + y * ILI9341_FB_PIXEL_HEIGHT;
+			_pushpixels_x1(p, ILI9341_FB_PIXEL_HEIGHT);
+			_pushpixels_x1(p, ILI9341_FB_PIXEL_HEIGHT);
+		}
+	} else {
+		// write full PASET/CASET now and we shall only update the start position from now on.
+		lcdSetWindow(0, 0, ILI9341_PHY_PIXEL_WIDTH - 1,
+				ILI9341_PHY_PIXEL_HEIGHT - 1);
+		_pushpixels_x2(fb, ILI9341_T4_NB_PIXELS);
+	}
+	LCD_CmdWrite(ILI9341_NOP);
+	_stats_last_pixels = ILI9341_T4_NB_PIXELS;
+	_stats_last_runs = 1;
+	_stats_last_time = _micros() - t0;
+}
+
+void ILI9341Driver::_pushRun(const uint16_t *fb, int off, int len) {
+	const int lx = ILI9341_FB_PIXEL_HEIGHT; // row length of the (rotated) framebuffer
+	int y = off / lx;
+	int x = off - y * lx;
+	if (x > 0) { // partial first row.
+		const int n = (lx - x < len) ? (lx - x) : len;
+		lcdSetWindow(x, 2 * y, x + n - 1, 2 * y + 1);
+		_pushpixels_x1(fb + off, n);
+		_pushpixels_x1(fb + off, n);
+		off += n;
+		len -= n;
+		y++;
+	}
+	const int nbrows = len / lx;
+	if (nbrows > 0) { // full rows: a single window.
+		lcdSetWindow(0, 2 * y, lx - 1, 2 * (y + nbrows) - 1);
+		for (int j = 0; j < nbrows; j++) {
+			_pushpixels_x1(fb + off, lx);
+			_pushpixels_x1(fb + off, lx);
+			off += lx;
+		}
+		len -= nbrows * lx;
+		y += nbrows;
+	}
+	if (len > 0) { // partial last row.
+		lcdSetWindow(0, 2 * y, len - 1, 2 * y + 1);
+		_pushpixels_x1(fb + off, len);
+		_pushpixels_x1(fb + off, len);
+	}
+}
+
+void ILI9341Driver::_updateRectNow(const uint16_t *sub_fb, int xmin, int xmax,
+		int ymin, int ymax, int stride) {
+	if (_hw_rotation) { // the panel follows the rotation: stream the region as it is.
+		const int w = xmax - xmin + 1;
+		if (_rotation & 1)
+			lcdSetWindow(xmin, 2 * ymin, xmax, 2 * ymax + 1);
+		else
+			lcdSetWindow(2 * xmin, ymin, 2 * xmax + 1, ymax);
+		for (int y = ymin; y <= ymax; y++) {
+			const uint16_t *p = sub_fb + stride * (y - ymin);
+			if (_rotation & 1) {
+				_pushpixels_x1(p, w);
+				_pushpixels_x1(p, w);
+			} else {
+				_pushpixels_x2(p, w);
+			}
+		}
+		LCD_CmdWrite(ILI9341_NOP);
+		return;
+	}
+	int x1, x2, y1, y2; // the region in orientation 0, i.e. in the panel order.
+	DiffBuffBase::rotationBox(_rotation, xmin, xmax, ymin, ymax, x1, x2, y1,
+			y2);
+	lcdSetWindow(2 * x1, y1, 2 * x2 + 1, y2); // the panel wraps the lines by itself.
+	const int w = x2 - x1 + 1;
+	for (int y = y1; y <= y2; y++) {
+		const uint16_t *p;
+		int step;
+		switch (_rotation) {
+		case 1:
+			p = sub_fb + (y - xmin)
+					+ stride * (ILI9341_FB_PIXEL_WIDTH - 1 - x1 - ymin);
+			step = -stride;
+			break;
+		case 2:
+			p = sub_fb + (ILI9341_FB_PIXEL_WIDTH - 1 - x1 - xmin)
+					+ stride * (ILI9341_FB_PIXEL_HEIGHT - 1 - y - ymin);
+			step = -1;
+			break;
+		case 3:
+			p = sub_fb + (ILI9341_FB_PIXEL_HEIGHT - 1 - y - xmin)
+					+ stride * (x1 - ymin);
+			step = stride;
+			break;
+		default:
+			_pushpixels_x2(sub_fb + (x1 - xmin) + stride * (y - ymin), w);
+			continue;
+		}
+		for (int i = 0; i < w; i++) {
+			const uint32_t c = *p;
+			LCD_DataWrite32(c | (c << 16));
+			p += step;
+		}
+	}
+	LCD_CmdWrite(ILI9341_NOP);
+}
+
+void ILI9341Driver::_pushRect(uint16_t color, int xmin, int xmax, int ymin,
+		int ymax) {
+	int x1, x2, y1, y2;
+	DiffBuffBase::rotationBox(_fbOrientation(), xmin, xmax, ymin, ymax, x1, x2,
+			y1, y2);
+	if (_rowsDoubled()) // same number of words: w pixels on 2 lines per row.
+		lcdSetWindow(x1, 2 * y1, x2, 2 * y2 + 1);
+	else
+		lcdSetWindow(2 * x1, y1, 2 * x2 + 1, y2);
+	const uint32_t c = ((uint32_t) color) | (((uint32_t) color) << 16);
+	for (int n = (x2 - x1 + 1) * (y2 - y1 + 1); n > 0; n--) {
+		LCD_DataWrite32(c);
+	}
+	LCD_CmdWrite(ILI9341_NOP);
+}
+
+/**********************************************************************************************************
+ * Asynchronous updates (DMA)
+ ***********************************************************************************************************/
+
+void ILI9341Driver::setDMA(DMA_HandleTypeDef *hdma) {
+	waitUploadDone();
+	_hdma = hdma;
+	if (_hdma == nullptr)
+		return;
+	_dma_word = (_hdma->Init.PeriphDataAlignment == DMA_PDATAALIGN_WORD);
+	HAL_DMA_RegisterCallback(_hdma, HAL_DMA_XFER_CPLT_CB_ID,
+			_dmaXferCpltStatic);
+	HAL_DMA_RegisterCallback(_hdma, HAL_DMA_XFER_ERROR_CB_ID,
+			_dmaXferErrorStatic);
+}
+
+void ILI9341Driver::updateAsync(const uint16_t *fb) {
+	waitUploadDone();
+	if ((_hdma == nullptr) || ((_fb1 == nullptr) && (_fbOrientation() != 0))) { // no dma or nothing to stream from: synchronous update.
+		update(fb);
+		if (_upload_cb)
+			_upload_cb(_upload_cb_param);
+		return;
+	}
+	if ((_dmaObject != nullptr) && (_dmaObject != this))
+		_dmaObject->waitUploadDone(); // another driver still owns the stream.
+	_dmaObject = this;
+
+	const bool sig = _sigDiff();
+	if ((_fb1_valid) && (!_rowsDoubled())
+			&& ((sig) ?
+					(_fbOrientation() == 0) : ((_fb1 != nullptr) && (_diff1 != nullptr)))) {
+		// differential upload: the diff is computed now and walked from the dma irq.
+		DiffBuffBase *diff = _diff1;
+		const uint32_t t = _micros();
+		if (sig) {
+			_diff1->computeDiff(nullptr, fb, 0, _diff_gap, true, _compare_mask);
+			if (_fb1) { // stream from the copy so that fb is free as soon as we return.
+				DiffBuffBase::copyfb(_fb1, fb, 0);
+				fb = _fb1;
+			}
+		} else {
+			if (_pending) { // merged with the changes not drawn yet (see update()).
+				diff = (_pending == _diff1) ? _diff2 : _diff1;
+				diff->computeDiff(_fb1, _pending, fb, 0, _width - 1, 0,
+						_height - 1, _width, _fbOrientation(), _diff_gap, true,
+						_compare_mask);
+				_pending = nullptr;
+			} else {
+				diff->computeDiff(_fb1, fb, _fbOrientation(), _diff_gap, true,
+						_compare_mask);
+			}
+			fb = _fb1; // up to date, in orientation 0.
+		}
+		_statsDiff(diff, t);
+		_dmaDiffStart(fb, diff);
+		return;
+	}
+
+	_stats_nb_frames++; // the bus time of a full dma upload is not measured.
+	_stats_nb_full++;
+
+	if (_sigDiff()) { // the next update() diffs against this frame.
+		_diff1->computeDiff(nullptr, fb, _fbOrientation(), _diff_gap, true,
+				_compare_mask);
+		_fb1_valid = true;
+	}
+	if (_fb1) { // stream from the mirror so that fb is free as soon as we return.
+		DiffBuffBase::copyfb(_fb1, fb, _fbOrientation());
+		if (!_sigDiff())
+			_fb1_valid = true;
+		_pending = nullptr;
+		fb = _fb1;
+	}
 
-	// write full PASET/CASET now and we shall only update the start position from now on.
-	lcdSetWindow(0, 0, ILI9341_PHY_PIXEL_WIDTH, ILI9341_PHY_PIXEL_HEIGHT);
+	const uint32_t *src;
+	_dma_rows = _rowsDoubled();
+	if (_dma_rows) {
+		// the panel walks the 240 pixel rows: send each one twice, straight from the framebuffer.
+		_dma_linelen = (_dma_word) ?
+				ILI9341_FB_PIXEL_HEIGHT / 2 : ILI9341_FB_PIXEL_HEIGHT;
+		src = (const uint32_t*) fb;
+	} else {
+		// both line buffers are ready before starting so the irq never waits for us.
+		_dma_linelen = (_dma_word) ?
+				ILI9341_FB_PIXEL_WIDTH : ILI9341_PHY_PIXEL_WIDTH;
+		_expandLine(_dma_linebuf[0], fb);
+		_expandLine(_dma_linebuf[1], fb + ILI9341_FB_PIXEL_WIDTH);
+		src = _dma_linebuf[0];
+	}
+	_dma_fb = fb;
+	_dma_line = 1;
+	_dma_nblines = (_dma_rows) ?
+			2 * ILI9341_FB_PIXEL_WIDTH : ILI9341_FB_PIXEL_HEIGHT;
+	_dma_busy = true;
 
-	for (int i = 0; i < ILI9341_T4_NB_PIXELS; ++i) {
-		LCD_DataWrite(fb[i]);
-		LCD_DataWrite(fb[i]);
+	if (_vsyncOn())
+		_waitFrameStart(); // start with the refresh: the dma stays ahead of the scanline.
+	if (_dma_rows)
+		lcdSetWindow(0, 0, ILI9341_PHY_PIXEL_HEIGHT - 1,
+				ILI9341_PHY_PIXEL_WIDTH - 1);
+	else
+		lcdSetWindow(0, 0, ILI9341_PHY_PIXEL_WIDTH - 1,
+				ILI9341_PHY_PIXEL_HEIGHT - 1);
+	if (HAL_DMA_Start_IT(_hdma, (uint32_t) src, LCD_BASE1, _dma_linelen)
+			!= HAL_OK) {
+		_dma_busy = false; // stream not ready: fall back to a blocking upload.
+		_pushFrameNow(fb);
+		if (_upload_cb)
+			_upload_cb(_upload_cb_param);
 	}
+}
+
+void ILI9341Driver::updateBand(const uint16_t *band, int y, int nblines) {
+	waitUploadDone();
+	_fb1_valid = false; // the screen no longer matches the mirror.
+	_pending = nullptr;
+	lcdSetWindow(0, y, nativeWidth() - 1, y + nblines - 1);
+	_pushpixels_x1(band, nativeWidth() * nblines);
 	LCD_CmdWrite(ILI9341_NOP);
 }
 
+void ILI9341Driver::updateBandAsync(const uint16_t *band, int y, int nblines) {
+	waitUploadDone();
+	const int nbpixels = nativeWidth() * nblines;
+	if ((_hdma == nullptr) || ((!_dma_word) && (nbpixels > 65535))) { // NDTR is 16 bits.
+		updateBand(band, y, nblines);
+		if (_upload_cb)
+			_upload_cb(_upload_cb_param);
+		return;
+	}
+	if ((_dmaObject != nullptr) && (_dmaObject != this))
+		_dmaObject->waitUploadDone();
+	_dmaObject = this;
+	_fb1_valid = false;
+	_pending = nullptr;
+
+	// the whole band goes in a single transfer: no line buffer, nothing to do in the irq.
+	_dma_rows = false;
+	_dma_fb = band;
+	_dma_line = 1;
+	_dma_nblines = 1;
+	_dma_linelen = (_dma_word) ? (nbpixels / 2) : nbpixels;
+	_dma_busy = true;
+	lcdSetWindow(0, y, nativeWidth() - 1, y + nblines - 1);
+	if (HAL_DMA_Start_IT(_hdma, (uint32_t) band, LCD_BASE1, _dma_linelen)
+			!= HAL_OK) {
+		_dma_busy = false;
+		_pushpixels_x1(band, nbpixels);
+		LCD_CmdWrite(ILI9341_NOP);
+		if (_upload_cb)
+			_upload_cb(_upload_cb_param);
+	}
+}
+
+void ILI9341Driver::setPalette(const uint16_t *palette) {
+	waitUploadDone(); // the irq may still be reading the previous one.
+	_palette = palette;
+}
+
+bool ILI9341Driver::_setupIndexed(const uint8_t *fb, bool native) {
+	if ((fb == nullptr) || (_palette == nullptr))
+		return false;
+	if (native) { // one index per physical pixel.
+		_dma_srclen = nativeWidth();
+		_dma_rowshift = 0;
+		_dma_double = false;
+		_dma_nblines = nativeHeight();
+	} else if (_rowsDoubled()) { // 240 pixel rows, each sent twice.
+		_dma_srclen = ILI9341_FB_PIXEL_HEIGHT;
+		_dma_rowshift = 1;
+		_dma_double = false;
+		_dma_nblines = 2 * ILI9341_FB_PIXEL_WIDTH;
+	} else {
+		if (_fbOrientation() != 0)
+			return false; // no software rotation for indexed framebuffers.
+		_dma_srclen = ILI9341_FB_PIXEL_WIDTH;
+		_dma_rowshift = 0;
+		_dma_double = true;
+		_dma_nblines = ILI9341_FB_PIXEL_HEIGHT;
+	}
+	_dma_fb8 = fb;
+	_dma_rows = false;
+	_fb1_valid = false; // the screen no longer matches the mirror.
+	_pending = nullptr;
+	// the line buffers hold one word per doubled pixel or per pixel pair.
+	const int nbwords = (_dma_double) ? _dma_srclen : (_dma_srclen / 2);
+	_dma_linelen = (_dma_word) ? nbwords : (2 * nbwords);
+	return true;
+}
+
+void ILI9341Driver::_expandLine8(uint32_t *dst, int line) {
+	const uint8_t *src = _dma_fb8 + (line >> _dma_rowshift) * _dma_srclen;
+	const uint16_t *pal = _palette;
+	if (_dma_double) {
+		for (int i = 0; i < _dma_srclen; i++) {
+			const uint32_t c = pal[src[i]];
+			dst[i] = c | (c << 16);
+		}
+	} else {
+		for (int i = 0; i < _dma_srclen / 2; i++) {
+			dst[i] = ((uint32_t) pal[src[2 * i]])
+					| (((uint32_t) pal[src[2 * i + 1]]) << 16);
+		}
+	}
+}
+
+void ILI9341Driver::updateIndexed(const uint8_t *fb, bool native) {
+	waitUploadDone();
+	if (!_setupIndexed(fb, native))
+		return;
+	const int nbwords = (_dma_double) ? _dma_srclen : (_dma_srclen / 2);
+	if (_vsyncOn())
+		_waitFrameStart();
+	lcdSetWindow(0, 0, nativeWidth() - 1, nativeHeight() - 1);
+	for (int l = 0; l < _dma_nblines; l++) {
+		if ((l & ((1 << _dma_rowshift) - 1)) == 0) // doubled rows are expanded once.
+			_expandLine8(_dma_linebuf[0], l);
+		for (int i = 0; i < nbwords; i++) {
+			LCD_DataWrite32(_dma_linebuf[0][i]);
+		}
+	}
+	LCD_CmdWrite(ILI9341_NOP);
+	_dma_fb8 = nullptr;
+}
+
+void ILI9341Driver::_setupScaled(const uint16_t *fb, int mode) {
+	const int sy = scaleY(mode);
+	_dma_sx = scaleX(mode);
+	_dma_srclen = nativeWidth() / _dma_sx;
+	_dma_rowshift = (sy == 4) ? 2 : ((sy == 2) ? 1 : 0);
+	_dma_nblines = nativeHeight();
+	_dma_fbs = fb;
+	_dma_rows = false;
+	_fb1_valid = false; // the screen no longer matches the mirror.
+	_pending = nullptr;
+	// the line buffers hold one word per native pixel pair.
+	_dma_linelen = (_dma_word) ? (nativeWidth() / 2) : nativeWidth();
+}
+
+void ILI9341Driver::_expandLineScaled(uint32_t *dst, int line) {
+	const uint16_t *src = _dma_fbs + (line >> _dma_rowshift) * _dma_srclen;
+	switch (_dma_sx) {
+	case 1:
+		for (int i = 0; i < _dma_srclen / 2; i++) {
+			dst[i] = ((uint32_t) src[2 * i])
+					| (((uint32_t) src[2 * i + 1]) << 16);
+		}
+		return;
+	case 2:
+		for (int i = 0; i < _dma_srclen; i++) {
+			const uint32_t c = src[i];
+			dst[i] = c | (c << 16);
+		}
+		return;
+	default: // 4
+		for (int i = 0; i < _dma_srclen; i++) {
+			const uint32_t c = src[i];
+			dst[2 * i] = dst[2 * i + 1] = c | (c << 16);
+		}
+		return;
+	}
+}
+
+void ILI9341Driver::updateScaled(const uint16_t *fb, int mode) {
+	if (fb == nullptr)
+		return;
+	waitUploadDone();
+	_setupScaled(fb, mode);
+	const int nbwords = nativeWidth() / 2;
+	if (_vsyncOn())
+		_waitFrameStart();
+	lcdSetWindow(0, 0, nativeWidth() - 1, nativeHeight() - 1);
+	for (int l = 0; l < _dma_nblines; l++) {
+		if ((l & ((1 << _dma_rowshift) - 1)) == 0) // replicated rows are expanded once.
+			_expandLineScaled(_dma_linebuf[0], l);
+		for (int i = 0; i < nbwords; i++) {
+			LCD_DataWrite32(_dma_linebuf[0][i]);
+		}
+	}
+	LCD_CmdWrite(ILI9341_NOP);
+	_dma_fbs = nullptr;
+}
+
+void ILI9341Driver::updateScaledAsync(const uint16_t *fb, int mode) {
+	if (fb == nullptr)
+		return;
+	waitUploadDone();
+	if (_hdma == nullptr) {
+		updateScaled(fb, mode);
+		if (_upload_cb)
+			_upload_cb(_upload_cb_param);
+		return;
+	}
+	if ((_dmaObject != nullptr) && (_dmaObject != this))
+		_dmaObject->waitUploadDone();
+	_dmaObject = this;
+	_setupScaled(fb, mode);
+	_expandLineScaled(_dma_linebuf[0], 0);
+	_expandLineScaled(_dma_linebuf[1], 1);
+	_dma_fb = nullptr;
+	_dma_line = 1;
+	_dma_busy = true;
+	if (_vsyncOn())
+		_waitFrameStart();
+	lcdSetWindow(0, 0, nativeWidth() - 1, nativeHeight() - 1);
+	if (HAL_DMA_Start_IT(_hdma, (uint32_t) _dma_linebuf[0], LCD_BASE1,
+			_dma_linelen) != HAL_OK) {
+		_dma_busy = false;
+		updateScaled(fb, mode);
+		if (_upload_cb)
+			_upload_cb(_upload_cb_param);
+	}
+}
+
+void ILI9341Driver::updateIndexedAsync(const uint8_t *fb, bool native) {
+	waitUploadDone();
+	if (_hdma == nullptr) {
+		updateIndexed(fb, native);
+		if (_upload_cb)
+			_upload_cb(_upload_cb_param);
+		return;
+	}
+	if ((_dmaObject != nullptr) && (_dmaObject != this))
+		_dmaObject->waitUploadDone();
+	_dmaObject = this;
+	if (!_setupIndexed(fb, native))
+		return;
+	_expandLine8(_dma_linebuf[0], 0);
+	_expandLine8(_dma_linebuf[1], 1);
+	_dma_fb = nullptr;
+	_dma_line = 1;
+	_dma_busy = true;
+	if (_vsyncOn())
+		_waitFrameStart();
+	lcdSetWindow(0, 0, nativeWidth() - 1, nativeHeight() - 1);
+	if (HAL_DMA_Start_IT(_hdma, (uint32_t) _dma_linebuf[0], LCD_BASE1,
+			_dma_linelen) != HAL_OK) {
+		_dma_busy = false;
+		updateIndexed(fb, native);
+		if (_upload_cb)
+			_upload_cb(_upload_cb_param);
+	}
+}
+
+void ILI9341Driver::waitUploadDone() {
+	while (_dma_busy) {
+	}
+}
+
+void ILI9341Driver::_expandLine(uint32_t *dst, const uint16_t *src) {
+	const uint32_t *p = (const uint32_t*) src;
+	for (int i = 0; i < ILI9341_FB_PIXEL_WIDTH / 2; i++) {
+		const uint32_t w = p[i];
+		dst[0] = (w << 16) | (w & 0xFFFF);
+		dst[1] = (w >> 16) | (w & 0xFFFF0000);
+		dst += 2;
+	}
+}
+
+void ILI9341Driver::_expandRun(uint32_t *dst, const uint16_t *src, int n) {
+	for (int i = 0; i < n; i++)
+		dst[i] = ((uint32_t) src[i]) * 0x10001;
+}
+
+void ILI9341Driver::_dmaDiffStart(const uint16_t *fb, DiffBuffBase *diff) {
+	_dma_rows = false;
+	_dma_fb = fb;
+	_dma_diff = diff;
+	_dma_left = 0;
+	_dma_pixels = 0;
+	_dma_runs = 0;
+	diff->initRead();
+	_dma_busy = true;
+	if (_vsyncOn())
+		_waitFrameStart(); // start with the refresh, as full uploads do.
+	_dma_t0 = _micros();
+	_dmaDiffPrepare(0);
+	_dma_cur = 1; // as if buffer 1 had just been sent.
+	_dmaDiffNext();
+}
+
+void ILI9341Driver::_dmaDiffPrepare(int b) {
+	DmaChunk &c = _dma_chunk[b];
+	c.win = false;
+	while (_dma_left <= 0) { // load the next instruction.
+		int x, y, w, h, len;
+		// no scanline to follow: the upload started with the refresh and stays ahead of it.
+		if (_dma_diff->rectangles()) {
+			if (_dma_diff->readRect(x, y, w, h, ILI9341_T4_NB_SCANLINES) != 0) {
+				c.n = 0;
+				return;
+			}
+			len = w * h;
+		} else {
+			if (_dma_diff->readDiff(x, y, len, ILI9341_T4_NB_SCANLINES) != 0) {
+				c.n = 0;
+				return;
+			}
+			w = (x > 0) ? len : DiffBuffBase::LX; // a run only wraps when it starts a line.
+		}
+		c.win = true;
+		c.x = x;
+		c.y = y;
+		c.w = w;
+		_dma_rx = x;
+		_dma_rw = w;
+		_dma_cx = x;
+		_dma_cy = y;
+		_dma_left = len;
+		_dma_runs++;
+	}
+	// as many lines of the instruction as the buffer holds: they follow each other in the window.
+	int n = 0;
+	while ((_dma_left > 0) && (n < DiffBuffBase::LX)) {
+		int k = _dma_rx + _dma_rw - _dma_cx; // rest of the line.
+		if (k > _dma_left)
+			k = _dma_left;
+		if (k > DiffBuffBase::LX - n)
+			k = DiffBuffBase::LX - n;
+		_expandRun(_dma_linebuf[b] + n,
+				_dma_fb + _dma_cx + DiffBuffBase::LX * _dma_cy, k);
+		n += k;
+		_dma_left -= k;
+		_dma_cx += k;
+		if (_dma_cx >= _dma_rx + _dma_rw) {
+			_dma_cx = _dma_rx;
+			_dma_cy++;
+		}
+	}
+	c.n = n;
+	_dma_pixels += n;
+}
+
+void ILI9341Driver::_dmaDiffNext() {
+	while (1) {
+		const int b = 1 - _dma_cur;
+		const DmaChunk &c = _dma_chunk[b];
+		if (c.n == 0) {
+			_dmaEnd();
+			return;
+		}
+		if (c.win)
+			lcdSetWindow(DiffBuffBase::panelX(c.x), DiffBuffBase::panelY(c.y),
+					DiffBuffBase::panelX(c.x + c.w) - 1,
+					ILI9341_PHY_PIXEL_HEIGHT - 1);
+		lcdAdvanceWritePointer(DiffBuffBase::SCALE_X * c.n);
+		_dma_cur = b;
+		if ((c.n >= ILI9341_T4_DMA_MIN_RUN)
+				&& (HAL_DMA_Start_IT(_hdma, (uint32_t) _dma_linebuf[b], LCD_BASE1,
+						(_dma_word) ? c.n : 2 * c.n) == HAL_OK)) {
+			_dmaDiffPrepare(1 - b); // refill the other buffer while this one is going out.
+			return;
+		}
+		// short piece (or stream not ready): write it now rather than wait for an irq.
+		for (int i = 0; i < c.n; i++)
+			LCD_DataWrite32(_dma_linebuf[b][i]);
+		_dmaDiffPrepare(1 - b);
+	}
+}
+
+void ILI9341Driver::_dmaNextLine() {
+	if (_dma_diff) {
+		_dmaDiffNext();
+		return;
+	}
+	const int line = _dma_line;
+	if (line >= _dma_nblines) {
+		_dmaEnd();
+		return;
+	}
+	if (_dma_rows) { // line l sends framebuffer row l/2.
+		HAL_DMA_Start_IT(_hdma,
+				(uint32_t) (_dma_fb + (line >> 1) * ILI9341_FB_PIXEL_HEIGHT),
+				LCD_BASE1, _dma_linelen);
+		_dma_line = line + 1;
+		return;
+	}
+	HAL_DMA_Start_IT(_hdma, (uint32_t) _dma_linebuf[line & 1], LCD_BASE1,
+			_dma_linelen);
+	_dma_line = line + 1;
+	if (line + 1 < _dma_nblines) { // refill the buffer just sent while this one is going out.
+		if (_dma_fb8)
+			_expandLine8(_dma_linebuf[(line + 1) & 1], line + 1);
+		else if (_dma_fbs)
+			_expandLineScaled(_dma_linebuf[(line + 1) & 1], line + 1);
+		else
+			_expandLine(_dma_linebuf[(line + 1) & 1],
+					_dma_fb + (line + 1) * ILI9341_FB_PIXEL_WIDTH);
+	}
+}
+
+void ILI9341Driver::_dmaEnd() {
+	LCD_CmdWrite(ILI9341_NOP);
+	if (_dma_diff) {
+		_stats_last_pixels = _dma_pixels;
+		_stats_last_runs = _dma_runs;
+		_stats_last_time = _micros() - _dma_t0;
+		_statsFrame(false);
+		_autoGap(_dma_diff->overflowed());
+		_dma_diff = nullptr;
+	}
+	_dma_fb = nullptr;
+	_dma_fb8 = nullptr;
+	_dma_fbs = nullptr;
+	_dma_busy = false;
+	if (_upload_cb)
+		_upload_cb(_upload_cb_param);
+}
+
+void ILI9341Driver::_dmaXferCpltStatic(DMA_HandleTypeDef *hdma) {
+	if ((_dmaObject) && (_dmaObject->_hdma == hdma))
+		_dmaObject->_dmaNextLine();
+}
+
+void ILI9341Driver::_dmaXferErrorStatic(DMA_HandleTypeDef *hdma) {
+	if ((_dmaObject) && (_dmaObject->_hdma == hdma)) {
+		_dmaObject->_fb1_valid = false; // part of the frame is missing: the next update redraws everything.
+		_dmaObject->_dmaEnd(); // give up on this frame.
+	}
+}
+
 void ILI9341Driver::_pushpixels_mode0(const uint16_t *fb, int x, int y,
 		int len) {
-	const uint16_t *p = fb + x + (y * ILI9341_FB_PIXEL_WIDTH);
-	while (len-- > 0) {
-		LCD_DataWrite(*p++);
-	}
+	_pushpixels_x2(fb + x + (y * ILI9341_FB_PIXEL_WIDTH), len);
 }
 
 void ILI9341Driver::_pushpixels_mode1(const uint16_t *fb, int xx, int yy,
@@ -120,7 +1537,8 @@ void ILI9341Driver::_pushpixels_mode1(const uint16_t *fb, int xx, int yy,
 	int x = yy;
 	int y = ILI9341_FB_PIXEL_WIDTH - 1 - xx;
 	while (len-- > 0) {
-		LCD_DataWrite(fb[x + ILI9341_FB_PIXEL_HEIGHT * y]);
+		const uint32_t c = fb[x + ILI9341_FB_PIXEL_HEIGHT * y];
+		LCD_DataWrite32(c | (c << 16));
 		y--;
 		if (y < 0) {
 			y = ILI9341_FB_PIXEL_WIDTH - 1;
@@ -135,7 +1553,8 @@ void ILI9341Driver::_pushpixels_mode2(const uint16_t *fb, int xx, int yy,
 	int y = ILI9341_FB_PIXEL_HEIGHT - 1 - yy;
 	const uint16_t *p = fb + x + (y * ILI9341_FB_PIXEL_WIDTH);
 	while (len-- > 0) {
-		LCD_DataWrite(*p--);
+		const uint32_t c = *p--;
+		LCD_DataWrite32(c | (c << 16));
 	}
 }
 
@@ -144,7 +1563,8 @@ void ILI9341Driver::_pushpixels_mode3(const uint16_t *fb, int xx, int yy,
 	int x = ILI9341_FB_PIXEL_HEIGHT - 1 - yy;
 	int y = xx;
 	while (len-- > 0) {
-		LCD_DataWrite(fb[x + ILI9341_FB_PIXEL_HEIGHT * y]);
+		const uint32_t c = fb[x + ILI9341_FB_PIXEL_HEIGHT * y];
+		LCD_DataWrite32(c | (c << 16));
 		y++;
 		if (y >= ILI9341_FB_PIXEL_WIDTH) {
 			y = 0;
@@ -466,8 +1886,11 @@ void ILI9341Driver::_uploadChar(char c, int &pos_x, int &pos_y, uint16_t col,
 
 	_drawCharILI(c, nx, ny, col, pfont, MAX_CHAR_SIZE_LX, MAX_CHAR_SIZE_LY,
 			MAX_CHAR_SIZE_LX, buffer, 1.0f); // draw the char on the buffer
-	_updateRectNow(buffer, pos_x, pos_x + max_x, pos_y - ny, pos_y + max_y - ny,
-			MAX_CHAR_SIZE_LX); // upload it to the screen
+	int xmin = pos_x, xmax = pos_x + max_x;
+	int ymin = pos_y - ny, ymax = pos_y + max_y - ny;
+	const uint16_t *p = buffer;
+	if (_clipRegion(p, xmin, xmax, ymin, ymax, MAX_CHAR_SIZE_LX))
+		_updateRectNow(p, xmin, xmax, ymin, ymax, MAX_CHAR_SIZE_LX); // upload it to the screen
 
 	pos_x += xa; //(nx + min_x);
 
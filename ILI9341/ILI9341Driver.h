@@ -36,12 +36,17 @@
 #ifdef __cplusplus
 
 #include "DiffBuff.h"
+#include "StatsVar.h"
 
 // #include <DMAChannel.h>
 // #include <SPI.h>
 #include <stdint.h>
 #include <cstdio>
 
+extern "C" {
+#include "ili9341.h"
+}
+
 namespace ILI9341_T4 {
 
 /** a few colors */
@@ -67,16 +72,24 @@ namespace ILI9341_T4 {
 
 /** Configuration */
 
-#define ILI9341_T4_DEFAULT_VSYNC_SPACING 2           // vsync on with framerate = refreshrate/2 = 45FPS. 
-#define ILI9341_T4_DEFAULT_DIFF_GAP 6                // default gap for diffs (typ. between 4 and 50)
+#define ILI9341_T4_DEFAULT_VSYNC_SPACING 2           // vsync on with framerate = refreshrate/2 (35FPS at 70Hz). 
+#define ILI9341_T4_DEFAULT_DIFF_GAP 4                // default gap for diffs (typ. between 4 and 50)
+#define ILI9341_T4_AUTO_GAP_FRAMES 16                // number of differential frames averaged before the automatic gap moves (see setDiffGapAuto())
+#define ILI9341_T4_AUTO_GAP_MIN 2                    // range explored by the automatic gap
+#define ILI9341_T4_AUTO_GAP_MAX 40
+#define ILI9341_T4_INTERLACE_STATIC_PIXELS (ILI9341_T4_NB_PIXELS / 16) // interlaced updates turn progressive when fewer pixels change per frame (see setInterlace())
 #define ILI9341_T4_DEFAULT_LATE_START_RATIO 0.3f     // default "proportion" of the frame admissible for late frame start when using vsync. 
 
-#define ILI9341_T4_TRANSACTION_DURATION 3           // number of pixels that could be uploaded during a typical CASET/PASET/RAWR sequence. 
+#define ILI9341_T4_TRANSACTION_DURATION 3           // number of pixels that could be uploaded while starting a new run (CASET + RAMWR on the same line, see lcdSetWindow()). 
 #define ILI9341_T4_RETRY_INIT 5                     // number of times we try initialization in begin() before returning an error. 
 #define ILI9341_T4_TFTWIDTH ILI9341_FB_PIXEL_WIDTH                     // screen dimension x (in default orientation 0)
 #define ILI9341_T4_TFTHEIGHT ILI9341_FB_PIXEL_HEIGHT                    // screen dimension y (in default orientation 0)
 #define ILI9341_T4_NB_SCANLINES ILI9341_T4_TFTHEIGHT// scanlines are mapped to the screen height
+#define ILI9341_T4_HW_SCANLINES 320                 // number of gate lines scanned by the panel (its native long axis)
+#define ILI9341_T4_REFRESH_SAMPLES 8                // number of refreshes timed when measuring the refresh period
+#define ILI9341_T4_SYNC_TIMEOUT 100000              // give up waiting for the scanline/TE after this many us (panel not answering)
 #define ILI9341_T4_MIN_WAIT_TIME  300               // minimum waiting time (in us) before drawing again when catching up with the scanline
+#define ILI9341_T4_DMA_MIN_RUN 16                   // asynchronous diff uploads write shorter pieces from the irq instead of starting a dma transfer
 
 #define ILI9341_T4_NB_PIXELS (ILI9341_T4_TFTWIDTH * ILI9341_T4_TFTHEIGHT)   // total number of pixels
 
@@ -96,6 +109,14 @@ namespace ILI9341_T4 {
 class ILI9341Driver {
 public:
 
+	typedef void (*callback_t)(void*);           // function callback signature 
+
+	/**
+	 * Constructor. Only sets the default parameters: the screen itself must
+	 * already be initialized with lcdInit() / lcdSetOrientation().
+	 **/
+	ILI9341Driver();
+
 	/**
 	 * Query the value of the self-diagnostic register.
 	 * 
@@ -121,18 +142,75 @@ public:
 	void invertDisplay(bool i);
 
 	/**
-	 * Set the vertical scroll offset.
+	 * Hardware scrolling (VSCRDEF / VSCRSADD).
+	 * 
+	 * The panel scrolls its memory circularly along its 320 gate lines, that is along the framebuffer
+	 * x axis in orientations 0/2 (horizontal scrolling) and along the y axis in orientations 1/3 
+	 * (vertical scrolling). A scroll 'line' below is a framebuffer column (orientations 0/2) or row
+	 * (orientations 1/3): there are scrollLength() = ILI9341_FB_PIXEL_WIDTH of them, each one being 
+	 * 2 panel lines. 
+	 * 
+	 * The framebuffer (and the screen memory) is used as a ring buffer: the content is never moved, 
+	 * only the line displayed first in the scrolling area changes. So update(), updateRegion()...
+	 * work as usual, in framebuffer coordinates. 
+	 * 
+	 * Needs hardware rotation (see setHardwareRotation()) for rotations other than 0. 
+	 **/
+
+	/**
+	 * Set the number of fixed lines at the start and at the end of the scroll axis (e.g. a title bar
+	 * and a status bar). The remaining lines form the scrolling area. Resets the scroll offset.
+	 **/
+	void setScrollArea(int fixed_start = 0, int fixed_end = 0);
+
+	/**
+	 * Set the scroll offset.
 	 *
-	 * Default value is 0 (no scroll). When an offset is set, the framebuffer is shifted vertically on 
-	 * the screen by the given offset. This means that the following (hardware) mapping is performed:
+	 * Default value is 0 (no scroll). When an offset is set, the scrolling area is shifted along the
+	 * scroll axis by the given offset. This means that the following (hardware) mapping is performed:
 	 * 
-	 * - framebuffer line i  =>  drawn at scanline (i - offset) mod TFT_HEIGHT. 
+	 * - framebuffer line fixed_start + i  =>  drawn at line fixed_start + (i - offset) mod L
 	 * 
-	 * offset can be any value (positive or negative) so that incrementing / decrementing it enables
-	 * to scroll up or down continuously.
+	 * where L is the length of the scrolling area. offset can be any value (positive or negative) so
+	 * that incrementing / decrementing it enables to scroll continuously.
 	 **/
 	void setScroll(int offset = 0);
 
+	/**
+	 * Return the current scroll offset (in [0, L[). 
+	 **/
+	int getScroll() const {
+		return _scroll_offset;
+	}
+
+	/**
+	 * Number of framebuffer lines along the scroll axis (fixed areas included). 
+	 **/
+	int scrollLength() const {
+		return ILI9341_FB_PIXEL_WIDTH;
+	}
+
+	/**
+	 * Return the framebuffer line currently drawn at position pos of the scrolling area (pos in 
+	 * [0, L[, 0 being the first line after the start fixed area). 
+	 **/
+	int scrollLine(int pos) const;
+
+	/**
+	 * Scroll by delta lines (see setScroll()) and clear the lines exposed by the scroll, in fb, in 
+	 * the internal framebuffer (if valid) and on the screen: 
+	 * 
+	 * - delta > 0 : the content moves towards the start, the exposed lines are the last delta 
+	 *               positions of the scrolling area, 
+	 * - delta < 0 : the content moves towards the end, the exposed lines are the first -delta 
+	 *               positions. 
+	 * 
+	 * Draw the new content in the exposed lines (scrollLine(pos)) and upload it with updateRegion()
+	 * or, with an internal framebuffer and a diff buffer, with update(): only the new pixels are 
+	 * sent instead of the whole screen (logs, charts, terminals...). 
+	 **/
+	void scroll(uint16_t *fb, int delta, uint16_t color = ILI9341_T4_COLOR_BLACK);
+
 	/** The 4 possible orientations */
 	enum {
 		PORTRAIT_240x320 = 0,
@@ -141,8 +219,37 @@ public:
 		LANDSCAPE_320x240_FLIPPED = 3,
 	};
 
+	/**
+	 * Set the orientation of the framebuffers given to the driver. 
+	 * 
+	 * With hardware rotation (default, see setHardwareRotation()), the panel addressing (MADCTL) is
+	 * reprogrammed and the internal framebuffer (if any) is invalidated. 
+	 **/
 	void setRotation(uint8_t r);
 
+	/**
+	 * Choose how rotated framebuffers are handled:
+	 * 
+	 * - true  : (default) the rotation is done by the panel: the MX/MY/MV bits of MADCTL are set so 
+	 *           that the framebuffer is always streamed linearly. Orientations 0/2 double each pixel 
+	 *           along the row and orientations 1/3 send each 240 pixel row twice, so every orientation
+	 *           costs the same upload time. The internal framebuffer is kept in the user orientation.
+	 * 
+	 * - false : the panel addressing is left alone (landscape, as set in main.cpp) and rotated 
+	 *           framebuffers are transposed in software while uploading (and in the internal 
+	 *           framebuffer, kept in orientation 0). 
+	 * 
+	 * Changing the mode invalidates the internal framebuffer. 
+	 **/
+	void setHardwareRotation(bool enable);
+
+	/**
+	 * Return true if the rotation is done by the panel (see setHardwareRotation()). 
+	 **/
+	bool getHardwareRotation() const {
+		return _hw_rotation;
+	}
+
 	int getRotation() const {
 		return _rotation;
 	}
@@ -199,6 +306,103 @@ public:
 		return _refreshmode;
 	}
 
+	/**
+	 * Return the refresh rate (in Hz) measured for the current refresh mode. 
+	 * 
+	 * Return 0 if no vsync timer is set (see setVSyncTimer()) or if the panel did not answer. 
+	 **/
+	float getRefreshRate() const {
+		return (_period > 0) ? (1000000.0f / _period) : 0.0f;
+	}
+
+	/***************************************************************************************************
+	 ****************************************************************************************************
+	 *
+	 * Vsync settings 
+	 * 
+	 * -> when vsync is on, a frame upload waits for the panel to start a new refresh and the diff is 
+	 *    then written just behind the scanline so that the screen never shows half of the old frame 
+	 *    and half of the new one. Frames are spaced by a fixed number of refreshes, which gives a 
+	 *    constant framerate (e.g. 35FPS for vsync_spacing = 2 at 70Hz) without spending any extra 
+	 *    bus bandwidth. 
+	 * 
+	 * -> the scanline is read back from the panel with the GETSCANLINE command or, if the TE pin is 
+	 *    wired to a GPIO (see setTearingPin()), deduced from the time elapsed since the last V-blank.
+	 *    A free running 1MHz hardware timer is used to measure the refresh period and to pace the 
+	 *    frames: vsync is only active once one is set with setVSyncTimer().
+	 *
+	 * -> the panel always scans along its native 320 pixel axis, so the scanline only tells which 
+	 *    lines are safe to write when the uploaded lines follow the gate lines in the scan order: 
+	 *    with hardware rotation in orientation 3, where each 240 pixel row is sent on two gate 
+	 *    lines (see _scanAligned()). Only then are differential updates written behind the 
+	 *    scanline. In the other orientations (e.g. orientation 0 with the landscape addressing of 
+	 *    main.cpp) every line written crosses every gate line: uploads then start exactly with a 
+	 *    refresh and run without waiting for the scanline. Vsync still locks the framerate to the 
+	 *    refresh rate but cannot rule out tearing: use orientation 3 for tear free updates. 
+	 *
+	 ****************************************************************************************************
+	 ****************************************************************************************************/
+
+	/**
+	 * Set the timer used by the vsync engine (nullptr to disable vsync). 
+	 * 
+	 * The timer must be a started, free running, 32 bit up-counter ticking at 1MHz (TIM2 with a 
+	 * prescaler of 83, see MX_TIM2_Init() in main.cpp). The refresh period is measured when the 
+	 * timer is set and each time the refresh mode changes. 
+	 **/
+	void setVSyncTimer(TIM_HandleTypeDef *htim);
+
+	/**
+	 * Use the TE (tearing effect) output of the panel, wired to the given GPIO input, instead of 
+	 * reading the scanline with GETSCANLINE. Set port to nullptr to go back to GETSCANLINE.
+	 * 
+	 * The TE output is enabled in V-blank only mode (lcdTearingOn(false)). 
+	 **/
+	void setTearingPin(GPIO_TypeDef *port, uint16_t pin);
+
+	/**
+	 * Set the vsync spacing, i.e. the number of screen refreshes between two frames:
+	 *
+	 * - 0  : vsync off: frames are uploaded as fast as possible and tearing may occur. 
+	 * - 1  : one frame per refresh, framerate = refresh rate. 
+	 * - 2  : one frame every other refresh, framerate = refresh rate / 2 (default).
+	 * - n  : framerate = refresh rate / n  (up to ILI9341_T4_MAX_VSYNC_SPACING).
+	 * 
+	 * If a frame is not ready in time, it is displayed at the next refresh (the framerate then 
+	 * drops for this frame but no tearing occurs). 
+	 **/
+	void setVSyncSpacing(int vsync_spacing = ILI9341_T4_DEFAULT_VSYNC_SPACING);
+
+	/**
+	 * Return the current vsync spacing (0 = vsync off).
+	 **/
+	int getVSyncSpacing() const {
+		return _vsync_spacing;
+	}
+
+	/**
+	 * Set how late a frame may start and still be shown at the refresh it was due for. 
+	 * 
+	 * When a frame is ready a little after the refresh it was scheduled for has started, it can 
+	 * still be uploaded right away (chasing the scanline) as long as the scanline has not gone 
+	 * further than ratio * ILI9341_T4_NB_SCANLINES. Otherwise the upload waits for the next refresh.
+	 * 
+	 * Only synchronous differential updates chasing the scanline (orientation 3 with hardware 
+	 * rotation, see the vsync settings above) may start late: other uploads always wait for the 
+	 * start of a refresh. 
+	 * 
+	 * - small ratio : safer (less risk of tearing) but more frames are delayed by a refresh.
+	 * - large ratio : fewer delayed frames but the upload may not keep up with the scanline. 
+	 **/
+	void setLateStartRatio(float ratio = ILI9341_T4_DEFAULT_LATE_START_RATIO);
+
+	/**
+	 * Return the current late start ratio. 
+	 **/
+	float getLateStartRatio() const {
+		return _late_start_ratio;
+	}
+
 	/**
 	 * Set the gap used when creating diffs. 
 	 * 
@@ -218,7 +422,8 @@ public:
 	 * You can use the printStats() to check how much memory the diff buffer typically consume. If the
 	 * diffs buffers overflow too often, you should either increase the gap or increase their size.
 	 * 
-	 * Remark: calling this method resets the statistics.
+	 * Remark: calling this method resets the statistics and disables the automatic gap (see 
+	 * setDiffGapAuto()).
 	 **/
 	void setDiffGap(int gap = ILI9341_T4_DEFAULT_DIFF_GAP);
 
@@ -229,6 +434,27 @@ public:
 		return _diff_gap;
 	}
 
+	/**
+	 * Let the driver choose the gap (default: off). 
+	 * 
+	 * The gap then follows the content: after every ILI9341_T4_AUTO_GAP_FRAMES differential updates, 
+	 * it moves by a step within [ILI9341_T4_AUTO_GAP_MIN, ILI9341_T4_AUTO_GAP_MAX] in the direction
+	 * that lowered the average bus cost of the frames (pixels uploaded + ILI9341_T4_TRANSACTION_DURATION 
+	 * per run) and it grows whenever the diff buffers overflow. Static content drifts toward small
+	 * gaps and full motion toward large ones, which keep the diffs within the buffers. 
+	 * 
+	 * Calling setDiffGap() disables it. The compare mask is never changed: it trades image fidelity 
+	 * and stays a user choice. 
+	 **/
+	void setDiffGapAuto(bool enable = true);
+
+	/**
+	 * Return true if the gap is chosen by the driver (see setDiffGapAuto()). 
+	 **/
+	bool getDiffGapAuto() const {
+		return _auto_gap;
+	}
+
 	/**
 	 * Set the mask used when creating a diff to check is a pixel is the same in both framebuffers. 
 	 * If the mask set is non-zero, then only the bits set in the mask are used for the comparison 
@@ -273,6 +499,33 @@ public:
 		return _compare_mask;
 	}
 
+	/**
+	 * Enable interlaced updates: update() uploads only the even rows (of the screen in orientation
+	 * 0) on one frame and the odd rows on the next, halving the bus traffic of full motion content
+	 * at the price of some combing on moving edges. Each row gets its own window: only PASET changes
+	 * from one row to the next (CASET is cached, see lcdSetWindow()). 
+	 * 
+	 * - With an internal framebuffer and a diff buffer, the diff is computed as usual but only the
+	 *   rows of the field are uploaded and copied into the mirror: the other rows stay in the next
+	 *   diff. If auto_progressive is set, the frames are uploaded whole again as long as fewer than 
+	 *   ILI9341_T4_INTERLACE_STATIC_PIXELS pixels change per frame, so static content is never left
+	 *   half drawn. 
+	 * 
+	 * - Without an internal framebuffer, every frame sends one field (no diff to tell static 
+	 *   content).
+	 * 
+	 * Signature diffs (DiffBuffSig), hardware rotation in orientations 1/3, force_full_redraw, 
+	 * updateRegion() and the asynchronous methods always upload progressively. 
+	 **/
+	void setInterlace(bool enable, bool auto_progressive = true);
+
+	/**
+	 * Return true if interlaced updates are enabled (see setInterlace()). 
+	 **/
+	bool getInterlace() const {
+		return _interlace;
+	}
+
 	/***************************************************************************************************
 	 ****************************************************************************************************
 	 *
@@ -281,6 +534,32 @@ public:
 	 ****************************************************************************************************
 	 ****************************************************************************************************/
 
+	/**
+	 * Set the internal framebuffer (nullptr to remove it). 
+	 * 
+	 * It must have room for ILI9341_T4_NB_PIXELS pixels and it is used to mirror the screen content
+	 * (always in orientation 0) in order to perform differential updates. When set, updateAsync() also 
+	 * uploads from it so the user framebuffer can be reused as soon as updateAsync() returns. 
+	 * 
+	 * Its content is considered invalid until the next full redraw. 
+	 **/
+	void setFramebuffer(uint16_t *fb1);
+
+	/**
+	 * Set the diff buffers used for differential updates (nullptr to remove them). 
+	 * 
+	 * Differential updates require an internal framebuffer (see setFramebuffer()) and at least 
+	 * one diff buffer. The second one is only used by updateRegion() to merge the changes that 
+	 * are not drawn yet. Any such pending change is discarded (the next update() is a full redraw).
+	 * 
+	 * If diff1 does not need the old framebuffer (DiffBuffSig), differential updates work without
+	 * any internal framebuffer: diff2 is then not used and the next update() is a full redraw.
+	 * 
+	 * Rectangle diffs (DiffBuffRect) are uploaded one window per rectangle. They can be mixed with 
+	 * the other kinds (e.g. a DiffBuffRect as diff1 and a DiffBuff as diff2). 
+	 **/
+	void setDiffBuffers(DiffBuffBase *diff1, DiffBuffBase *diff2 = nullptr);
+
 	/**
 	 * Clear the screen to a single color (default black). 
 	 *
@@ -291,8 +570,8 @@ public:
 	/**
 	 *                                 MAIN SCREEN UPDATE METHOD
 	 *
-	 * Push a framebuffer to be displayed on the screen. The behavior of the method depend on the
-	 * current buffering mode and the vsync_spacing parameter.
+	 * Push a framebuffer to be displayed on the screen. The behavior of the method depends on 
+	 * whether an internal framebuffer and a diff buffer are set (see below).
 	 *
 	 * - fb : the framebuffer to draw unto the screen.     
 	 *  
@@ -303,58 +582,39 @@ public:
 	 *                      some CPU times that would have been used for creating the diff (around 1us 
 	 *                      normally).
 	 *
-	 * WHEN THE METHOD RETURNS, THE FRAME MAY OR MAY NOT ALREADY BE DISPLAYED ONT THE SCREEN BUT
-	 * THE INPUT FRAMEBUFFER fb CAN STILL BE REUSED IMMEDIATELY IN ANY CASE. (when using async updates,
-	 * the internal framebuffer is used to save a copy of the framebuffer).
+	 * WHEN THE METHOD RETURNS, THE FRAME IS DISPLAYED ON THE SCREEN AND THE INPUT FRAMEBUFFER fb
+	 * CAN BE REUSED IMMEDIATELY (use updateAsync() to upload in the background).
 	 *
 	 * 
-	 * The exact behavior of the method depends on bufferingMode():
+	 * The exact behavior of the method depends on the buffers set:
 	 *
 	 * 
-	 * -> NO_BUFFERING (i.e. no internal framebuffer set):
-	 *
-	 *   The framebuffer is pushed to the screen immediately and the method returns only when upload is 
-	 *   complete. In this mode, differential upload are always disabled: the whole screen is updated
-	 *   and diff buffers, if present, are ignored. 
+	 * -> no internal framebuffer or no diff buffer:
 	 *
-	 *   - if vsync_spacing <= 0, upload to the screen start immediately (no VSync).
-	 *
-	 *   - if vsync_spacing >= 1, screen upload is synchronized with the screen refresh (VSync) and the
-	 *     method waits until vsync_spacing refreshes have occurred since the previous update to insure
-	 *     a constant framerate equal to (refresh_rate/vsync_spacing).
+	 *   The whole framebuffer is pushed to the screen. 
 	 * 
 	 *
-	 * -> DOUBLE_BUFFERING (internal framebuffer set)
-	 *
-	 *   All updates are done asynchronously via DMA and the method returns asap. If 1 or 2 diff buffers
-	 *   are present, they are automatically used to perform differential update: only the portion of
-	 *   the screen whose content has changed is redrawn. 
-	 *
-	 *   - if vsync_spacing = -1, upload to the screen starts immediately unless there is already a
-	 *     transfer in progress in which case the frame is simply dropped and the method return without
-	 *     doing anything (no VSync).
+	 * -> internal framebuffer + diff buffer (c.f. setFramebuffer() and setDiffBuffers()):
 	 *
-	 *   - if vsync_spacing = 0, upload to the screen start immediately unless there is already a
-	 *     transfer in progress in which case the method waits until the transfer completes and then 
-	 *     starts another async transfer immediately (no VSync).
-	 *
-	 *   - if vsync_spacing > 0. screen upload is synchronized with the screen refresh and the
-	 *     method waits until vsync_spacing refreshes have occurred since the previous update to
-	 *     insure a constant framerate equal to (refresh_rate/vsync_spacing). If a transfer is
-	 *     already in progress, it waits for it to complete before scheduling the next transfer
-	 *     via DMA and returning.
+	 *   The internal framebuffer mirrors the content of the screen. A diff between the mirror and fb 
+	 *   is computed (the mirror being updated at the same time) and only the runs of pixels that 
+	 *   changed are uploaded. Runs are separated by at least getDiffGap() identical pixels and pixels
+	 *   are compared using getCompareMask(). The first update after setting the mirror is always a 
+	 *   full redraw.
 	 * 
 	 *
-	 * NOTE: 
-	 *       (1) double buffering give a HUGE improvement over the no buffering method at the
-	 *           expense of an additional internal memory framebuffer (150Kb).
+	 * -> signature diff buffer (DiffBuffSig, no internal framebuffer needed): 
+	 * 
+	 *   The diff compares the signature of each row (or row segment) of fb with the one uploaded
+	 *   previously and only the rows that changed are uploaded. 
+	 * 
 	 *
-	 *       (2) Setting two diffs buffers instead of one cost only a few additional kilobytes
-	 *           yet will usually improve the max framerate significantly since it enables the
-	 *           driver to compute the next diff while the previous update is still ongoing.
-	 *        
-	 *              
-	 * ADVICE:  US AN INTERNAL FRAMEBUFFER + 2 DIFF BUFFERS (WITH SIZE RANGING FROM 5K TO 10K).
+	 * NOTE: the internal framebuffer costs ILI9341_T4_NB_PIXELS*2 bytes whereas a diff buffer of a 
+	 *       few kilobytes is usually enough (see setDiffGap() for advice on choosing its size). 
+	 * 
+	 * When vsync is on (see setVSyncSpacing()), the method first waits for the refresh the frame is 
+	 * due for and then writes the pixels just behind the scanline. 
+	 * 
 	 * 
 	 **/
 	void update(const uint16_t *fb, bool force_full_redraw = false);
@@ -362,18 +622,16 @@ public:
 	/**
 	 *                             PARTIAL SCREEN UPDATE METHOD
 	 *
-	 * Update only part of the screen. The behavior of the method depend on the current buffering 
-	 * mode and the vsync_spacing parameter.
+	 * Update only a rectangular region of the screen. 
 	 *
-	 * WHEN THE METHOD RETURNS, THE FRAME MAY OR MAY NOT ALREADY BE DISPLAYED ON THE SCREEN BUT
-	 * THE INPUT FRAMEBUFFER fb CAN STILL BE REUSED IMMEDIATELY IN ANY CASE (A COPY IS MADE WHEN
-	 * USING ASYNC UPDATES).
+	 * WHEN THE METHOD RETURNS, THE INPUT FRAMEBUFFER fb CAN BE REUSED IMMEDIATELY. 
 	 *
 	 * Parameters:
 	 * 
 	 * - fb : framebuffer to the rectangular region to update.     
 	 * 
-	 * - [xmin, xmax] x [ymin, ymax] : region of the screen to update  
+	 * - [xmin, xmax] x [ymin, ymax] : region of the screen to update (w.r.t. the current rotation, 
+	 *                                 clipped to the screen).  
 	 * 
 	 * - stride : stride for the supplied framebuffer fb
 	 *
@@ -384,28 +642,294 @@ public:
 	 *            -> If stride is not specified, it defaults to (xmax - xmin + 1) which is the
 	 *                width of the rectangular region.
 	 *    
-	 * - redrawNow: - If set to true, the screen is redrawn immediately (async if an internal   
-	 * -              framebuffer is set). 
-	 *              - If set to false and an internal framebuffer is available, then the changes   
-	 *                are stored in the internal framebuffer but are not drawn on the screen. 
-	 *                This permits to call regionUpdate() several times without drawing onto the 
-	 *                screen and then draw all the changes simultaneously when needed. This is 
-	 *                particularly convenient when using the lvgl library. 
+	 * - redrawNow: - If set to true, the region (and any change stored before) is drawn on the 
+	 *                screen before the method returns.
+	 *              - If set to false and the internal framebuffer mirrors the screen, then the 
+	 *                changes are stored in the internal framebuffer but are not drawn on the screen. 
+	 *                This permits to call updateRegion() several times without drawing onto the 
+	 *                screen and then draw all the changes simultaneously when needed (with a last 
+	 *                call with redrawNow=true or with the next update()). 
+	 *
 	 *
+	 * NOTE: (1) A region drawn directly uses a single CASET/PASET window (the x coordinates being 
+	 *           doubled to the panel width) and its pixels are streamed in the panel order whatever 
+	 *           the rotation, so a small widget or sprite only costs a few microseconds.  
 	 *
-	 * NOTE: (1) Similarly to the 'update()' method, this method will use VSync when enabled
-	 *           depending on the value of the vsync_spacing parameter 
+	 *       (2) If there is no internal framebuffer (or if it does not mirror the screen yet, i.e.
+	 *           before the first update()), the region is drawn immediately even if redrawNow=false.  
 	 *
-	 *       (2) In there is no internal buffer, then screen is updated immediately even if
-	 *           redrawNow=false.  
+	 *       (3) Stored changes are merged in a diff, which requires TWO DIFF BUFFERS (see 
+	 *           setDiffBuffers()). With fewer, the whole lines of the internal framebuffer touched 
+	 *           by the stored changes are redrawn instead. 
 	 *
-	 *       (3) For this method, TWO DIFF BUFFERS ARE REQUIRED FOR DIFFERENTIAL UPDATE !
-	 *           Setting only one diff buffer will disable differential updates :(
+	 *       (4) Similarly to update(), stored changes are drawn with vsync when it is enabled. 
 	 *
 	 **/
 	void updateRegion(bool redrawNow, const uint16_t *fb, int xmin, int xmax,
 			int ymin, int ymax, int stride = -1);
 
+	/**
+	 *                             DAMAGE UPDATE METHOD
+	 *
+	 * Update the screen with the rectangles of fb listed in damage, usually filled by the
+	 * ILI9341Wrapper drawing into fb (see ILI9341Wrapper::setDamage()). Nothing is compared: the
+	 * rectangles are uploaded as a rectangle diff (one window each) and damage is cleared for the
+	 * next frame. An animation that only redraws what moves then only pays for that.
+	 *
+	 * The screen must show the previous frame outside the damage, as it does after any update.
+	 * The internal framebuffer (if set) is updated with the damaged rectangles and signature diffs
+	 * forget the lines they cover.
+	 *
+	 * NOTE: (1) If the screen content is not known yet (internal framebuffer or signatures not
+	 *           valid) or with hardware rotation in orientations 1/3, this is simply update(fb).
+	 *
+	 *       (2) Changes stored by updateRegion() are drawn first.
+	 *
+	 *       (3) The damage must be recorded with the orientation of the framebuffers, i.e. the
+	 *           rotation when it is done in software and 0 otherwise.
+	 **/
+	void updateDamage(const uint16_t *fb, DiffBuffRect *damage);
+
+	/***************************************************************************************************
+	 ****************************************************************************************************
+	 *
+	 * Asynchronous updates (DMA)
+	 * 
+	 * -> the framebuffer is streamed to the FSMC data address (LCD_BASE1) by a DMA2 stream configured 
+	 *    in memory-to-memory mode. Each framebuffer line is expanded to the physical width in a small
+	 *    line buffer (one 32 bit word per doubled pixel) and the next line is prepared from the transfer
+	 *    complete interrupt while the current one is being sent so the CPU is free during most of the 
+	 *    upload. With hardware rotation in orientations 1/3, the rows are streamed straight from the
+	 *    framebuffer (each one twice) and no expansion is needed. 
+	 * 
+	 * -> differential uploads are walked from the interrupt as well: each transfer complete interrupt
+	 *    sets the window of the next diff instruction if needed and starts the transfer of the next 
+	 *    piece (up to a line buffer, expanded in the one that just went out). Pieces shorter 
+	 *    than ILI9341_T4_DMA_MIN_RUN pixels are written directly from the interrupt. 
+	 *
+	 ****************************************************************************************************
+	 ****************************************************************************************************/
+
+	/**
+	 * Set the DMA stream used for asynchronous updates (nullptr to disable them). 
+	 * 
+	 * The stream must be a DMA2 stream in memory-to-memory mode with source increment enabled and 
+	 * destination increment disabled (see MX_DMA_Init() in main.cpp). Its IRQ handler must call 
+	 * HAL_DMA_IRQHandler(). The driver registers its own transfer complete / error callbacks on the
+	 * handle. 
+	 * 
+	 * The data width is read from the handle: 
+	 * - word      : each transfer carries a doubled pixel pair (the FSMC splits it in two 16 bit 
+	 *               bus cycles) so a line needs only ILI9341_FB_PIXEL_WIDTH transfers (recommended). 
+	 * - half-word : one transfer per physical pixel. 
+	 **/
+	void setDMA(DMA_HandleTypeDef *hdma);
+
+	/**
+	 * Start uploading a framebuffer to the screen and return immediately. 
+	 * 
+	 * If a previous upload is still ongoing, the method first waits for it to complete. 
+	 * 
+	 * If an internal framebuffer is set (see setFramebuffer()), fb is first copied into it and the
+	 * upload streams from the copy: fb can then be reused as soon as the method returns. Otherwise, 
+	 * THE FRAMEBUFFER IS READ UNTIL THE UPLOAD COMPLETES: it must not be modified before 
+	 * waitUploadDone() returns (or asyncUploadActive() returns false). Work that does not
+	 * touch fb can be done in the meantime. 
+	 * 
+	 * Differential updates work as with update() (same diff buffers and conditions) except in 
+	 * orientations 1/3 with hardware rotation: the diff is computed before the method returns and 
+	 * only the pixels it lists are uploaded. Like full frames, they start with a refresh (if vsync 
+	 * is on) and then run ahead of the scanline without waiting for it. With a signature diff 
+	 * (DiffBuffSig) and no internal framebuffer, fb is read until the upload completes. 
+	 * 
+	 * If no DMA stream is set, or if the rotation is done in software (see setHardwareRotation()) 
+	 * with a rotation other than 0 and there is no internal framebuffer, this method simply calls 
+	 * update(fb). 
+	 **/
+	void updateAsync(const uint16_t *fb);
+
+	/**
+	 * Return true if an asynchronous upload is currently in progress. 
+	 **/
+	bool asyncUploadActive() const {
+		return _dma_busy;
+	}
+
+	/**
+	 * Wait until the current asynchronous upload (if any) is complete. 
+	 **/
+	void waitUploadDone();
+
+	/**
+	 * Set a callback called when an asynchronous upload completes (nullptr to remove it). 
+	 * 
+	 * WARNING: the callback is called from the DMA interrupt so it should be short and must
+	 * not start another upload. 
+	 **/
+	void setUploadDoneCallback(callback_t cb, void *param = nullptr) {
+		_upload_cb = cb;
+		_upload_cb_param = param;
+	}
+
+	/***************************************************************************************************
+	 ****************************************************************************************************
+	 *
+	 * Band uploads (native resolution)
+	 * 
+	 * -> the screen is rendered at the native panel resolution in horizontal bands of a few lines held
+	 *    in small buffers (see BandRenderer.h) instead of a pixel doubled framebuffer. Each band is 
+	 *    sent without any conversion (one 32 bit store / dma word per pixel pair) so, with two band 
+	 *    buffers, the next band renders while the previous one is streamed by the DMA. 
+	 * 
+	 * -> band uploads bypass the internal framebuffer, which is invalidated (the next update() is a
+	 *    full redraw), and are not synchronized with the refresh. 
+	 *
+	 ****************************************************************************************************
+	 ****************************************************************************************************/
+
+	/**
+	 * Width of a band line: the native panel width in the current addressing (320, or 240 for 
+	 * orientations 1/3 with hardware rotation). 
+	 **/
+	int nativeWidth() const {
+		return (_rowsDoubled()) ? ILI9341_PHY_PIXEL_HEIGHT : ILI9341_PHY_PIXEL_WIDTH;
+	}
+
+	/**
+	 * Number of native lines (240, or 320 for orientations 1/3 with hardware rotation).
+	 **/
+	int nativeHeight() const {
+		return (_rowsDoubled()) ? ILI9341_PHY_PIXEL_WIDTH : ILI9341_PHY_PIXEL_HEIGHT;
+	}
+
+	/**
+	 * Upload a band holding native lines [y, y + nblines[ (nativeWidth() pixels each) and return
+	 * when done. 
+	 **/
+	void updateBand(const uint16_t *band, int y, int nblines);
+
+	/**
+	 * Start uploading a band with the DMA and return immediately (waits first for the previous 
+	 * upload to complete). The band buffer is read until the upload completes (asyncUploadActive())
+	 * and must be word aligned and DMA accessible (i.e. not in CCM RAM). 
+	 * 
+	 * Falls back to updateBand() if no DMA stream is set or if the band is too long for a single 
+	 * half-word transfer. 
+	 **/
+	void updateBandAsync(const uint16_t *band, int y, int nblines);
+
+	/***************************************************************************************************
+	 ****************************************************************************************************
+	 *
+	 * Indexed framebuffers (8 bits per pixel)
+	 * 
+	 * -> each pixel is a byte indexing a 256 entries RGB565 palette (CLUT). The lines are expanded
+	 *    through the palette while they are uploaded (in the DMA line buffers for async uploads) so 
+	 *    the framebuffer takes half the memory: a full native 320x240 framebuffer fits in 75KB. 
+	 * 
+	 * -> the palette is not copied: changing some of its entries and uploading the same framebuffer
+	 *    again recolors the whole screen without drawing anything (palette cycling). 
+	 * 
+	 * -> indexed uploads always redraw the whole screen, bypass the internal framebuffer (which is 
+	 *    invalidated) and need hardware rotation (see setHardwareRotation()) for rotations other
+	 *    than 0. Use ILI9341Wrapper8 to draw on an indexed framebuffer. 
+	 *
+	 ****************************************************************************************************
+	 ****************************************************************************************************/
+
+	/**
+	 * Set the palette used by indexed uploads: 256 RGB565 colors (nullptr to disable indexed uploads).
+	 * 
+	 * The palette is read during the upload: do not modify it while an async upload is ongoing. 
+	 **/
+	void setPalette(const uint16_t *palette);
+
+	/**
+	 * Return the current palette. 
+	 **/
+	const uint16_t* getPalette() const {
+		return _palette;
+	}
+
+	/**
+	 * Upload an indexed framebuffer and return when done. 
+	 * 
+	 * - native = false : the framebuffer has the same layout as the RGB565 ones (see setRotation())
+	 *                    and is pixel doubled on the screen. 
+	 * - native = true  : the framebuffer has the native resolution: nativeHeight() lines of 
+	 *                    nativeWidth() pixels. 
+	 **/
+	void updateIndexed(const uint8_t *fb, bool native = false);
+
+	/**
+	 * Start uploading an indexed framebuffer with the DMA and return immediately (waits first for 
+	 * the previous upload to complete). THE FRAMEBUFFER AND THE PALETTE ARE READ UNTIL THE UPLOAD 
+	 * COMPLETES. Falls back to updateIndexed() if no DMA stream is set. 
+	 **/
+	void updateIndexedAsync(const uint8_t *fb, bool native = false);
+
+	/***************************************************************************************************
+	 ****************************************************************************************************
+	 *
+	 * Scaled framebuffers (dynamic resolution)
+	 * 
+	 * -> the framebuffer holds the screen at a reduced resolution and each pixel is replicated on 
+	 *    upload: SCALE_1X1 (native), SCALE_2X1 (doubled horizontally, as the usual framebuffer), 
+	 *    SCALE_2X2 or SCALE_4X4. The mode can change with every frame so that the render resolution 
+	 *    follows the render time (see ScaleController.h). The same buffer, sized for the finest mode 
+	 *    used, serves all of them. 
+	 * 
+	 * -> the layout is the native one (as for band uploads): scaledHeight(mode) lines of 
+	 *    scaledWidth(mode) pixels. The lines are replicated in the line buffers while they are 
+	 *    uploaded (in the DMA interrupt for async uploads). 
+	 * 
+	 * -> scaled uploads always redraw the whole screen and bypass the internal framebuffer (which is 
+	 *    invalidated). A native SCALE_1X1 buffer takes 150KB and does not fit in the internal RAM of 
+	 *    the STM32F407 next to anything else: use the coarser modes or external memory. 
+	 *
+	 ****************************************************************************************************
+	 ****************************************************************************************************/
+
+	/** pixel replication modes of scaled uploads, from the finest to the coarsest */
+	enum ScaleMode {
+		SCALE_1X1 = 0, SCALE_2X1 = 1, SCALE_2X2 = 2, SCALE_4X4 = 3
+	};
+
+	static const int NB_SCALE_MODES = 4;
+
+	/** horizontal replication factor of a scale mode */
+	static int scaleX(int mode) {
+		return (mode <= SCALE_1X1) ? 1 : ((mode >= SCALE_4X4) ? 4 : 2);
+	}
+
+	/** vertical replication factor of a scale mode */
+	static int scaleY(int mode) {
+		return (mode <= SCALE_2X1) ? 1 : ((mode >= SCALE_4X4) ? 4 : 2);
+	}
+
+	/** width of a scaled framebuffer (pixels per line) */
+	int scaledWidth(int mode) const {
+		return nativeWidth() / scaleX(mode);
+	}
+
+	/** number of lines of a scaled framebuffer */
+	int scaledHeight(int mode) const {
+		return nativeHeight() / scaleY(mode);
+	}
+
+	/**
+	 * Upload a scaled framebuffer (scaledHeight(mode) lines of scaledWidth(mode) pixels) and 
+	 * return when done. 
+	 **/
+	void updateScaled(const uint16_t *fb, int mode);
+
+	/**
+	 * Start uploading a scaled framebuffer with the DMA and return immediately (waits first for 
+	 * the previous upload to complete). THE FRAMEBUFFER IS READ UNTIL THE UPLOAD COMPLETES. Falls 
+	 * back to updateScaled() if no DMA stream is set. 
+	 **/
+	void updateScaledAsync(const uint16_t *fb, int mode);
+
 	/**
 	 * Overlay a text on the supplied framebuffer at a given position and with 
 	 * given color (for text and background). 
@@ -430,18 +954,130 @@ public:
 			float fg_opacity = 1.0f, uint16_t bg_color = ILI9341_T4_COLOR_BLACK,
 			float bk_opacity = 0.0f, bool extend_bg_whole_width = false);
 
+	/***************************************************************************************************
+	 ****************************************************************************************************
+	 *
+	 * Statistics 
+	 * 
+	 * -> every frame given to update() / updateAsync() is counted. For the synchronous uploads, 
+	 *    the driver also records the upload time (bus time only, the wait for the vsync slot is 
+	 *    not included), the number of pixels and runs sent and, for differential updates, the time 
+	 *    taken to compute the diff, its size and whether it overflowed its buffer. 
+	 * 
+	 * -> use these to dimension the diff buffers and to choose the gap (or let setDiffGapAuto() 
+	 *    do it). Changing the gap or the refresh mode resets the statistics. 
+	 *
+	 ****************************************************************************************************
+	 ****************************************************************************************************/
+
+	/**
+	 * Reset all the statistics. 
+	 **/
+	void statsReset();
+
+	/**
+	 * Print the statistics (with printf). 
+	 **/
+	void printStats() const;
+
+	/** Number of frames since the last reset. */
+	uint32_t statsNbFrames() const {
+		return _stats_nb_frames;
+	}
+
+	/** Number of frames uploaded without a diff (first frame, forced or asynchronous updates...). */
+	uint32_t statsNbFullRedraws() const {
+		return _stats_nb_full;
+	}
+
+	/** Number of differential updates whose diff overflowed its buffer. */
+	uint32_t statsNbOverflows() const {
+		return _stats_nb_overflow;
+	}
+
+	/** Upload time of the synchronous frames (in us). */
+	const StatsVar& statsUploadTime() const {
+		return _stats_uploadtime;
+	}
+
+	/** Pixels (of the framebuffer) uploaded per synchronous frame. */
+	const StatsVar& statsPixels() const {
+		return _stats_pixels;
+	}
+
+	/** Runs (window changes) per synchronous frame. */
+	const StatsVar& statsRuns() const {
+		return _stats_runs;
+	}
+
+	/** Time taken to compute the diffs (in us). */
+	const StatsVar& statsDiffTime() const {
+		return _stats_difftime;
+	}
+
+	/** Size of the diffs (in bytes). */
+	const StatsVar& statsDiffSize() const {
+		return _stats_diffsize;
+	}
+
 private:
 
 	/**********************************************************************************************************
 	 * General settings.
 	 ***********************************************************************************************************/
 
-	typedef void (*callback_t)(void*);           // function callback signature 
 	using methodCB_t = void (ILI9341Driver::*)(void); // typedef to method callback. 
 
 	int16_t _width, _height;  // Display w/h as modified by current rotation    
 	int _rotation;                          // current screen orientation
-	int _refreshmode; // refresh mode (between 0 = fastest refresh rate and 15 = slowest refresh rate). 
+	bool _hw_rotation;                      // true if the rotation is done by the panel (MADCTL). 
+
+	/** orientation of the framebuffers w.r.t. the panel addressing (what DiffBuff should rotate) */
+	int _fbOrientation() const {
+		return (_hw_rotation) ? 0 : _rotation;
+	}
+
+	/**
+	 * true if the panel addressing runs along the 240 pixel rows of a rotated framebuffer: each row 
+	 * is then sent twice instead of doubling each pixel. 
+	 **/
+	bool _rowsDoubled() const {
+		return ((_hw_rotation) && (_rotation & 1));
+	}
+
+	/** true if diff1 keeps row signatures instead of comparing with the mirror (see DiffBuffSig) */
+	bool _sigDiff() const {
+		return ((_diff1) && (!_diff1->requiresOldFramebuffer()));
+	}
+
+	/** make the signatures of diff1 forget a region drawn without it */
+	void _sigForget(int xmin, int xmax, int ymin, int ymax);
+
+	/**********************************************************************************************************
+	 * Scrolling
+	 ***********************************************************************************************************/
+
+	int _scroll_start;                      // fixed lines at the start of the scroll axis (framebuffer lines).
+	int _scroll_end;                        // fixed lines at the end of the scroll axis.
+	int _scroll_offset;                     // current offset in [0, scroll area length[.
+
+	/** true if the scroll axis runs opposite to the panel memory lines in the current orientation */
+	bool _scrollReversed() const {
+		return ((_hw_rotation) && ((_rotation == 1) || (_rotation == 2)));
+	}
+
+	/** true if scrolling is possible in the current orientation */
+	bool _scrollOn() const {
+		return ((_hw_rotation) || (_rotation == 0));
+	}
+
+	/** write the scroll area and the scroll offset to the panel */
+	void _applyScroll();
+
+	/** fill framebuffer line l of the scroll axis with color, in fb (with stride _width) */
+	void _fillScrollLine(uint16_t *fb, int l, uint16_t color);
+
+	int _refreshmode; // refresh mode (between 0 = fastest refresh rate and 31 = slowest refresh rate). 
 
 	int _irq_priority; // priority at which we run all IRQ's (dma, pit timer and spi interrupts)
 
@@ -494,19 +1130,142 @@ private:
 	volatile bool _late_start_ratio_override; // if true the next frame upload will wait for the scanline to start a next frame. 
 	volatile uint16_t _compare_mask; // the compare mask used to compare pixels when doing a diff
 
-	//DiffBuffStatic<ILI9341_T4_NB_PIXELS>* _diff1;
-	//uint16_t* _fb1;
+	/***************************************************************************************************
+	 * Statistics and automatic gap
+	 ***************************************************************************************************/
+
+	uint32_t _stats_nb_frames;       // frames since the last reset
+	uint32_t _stats_nb_full;         // ... uploaded without a diff
+	uint32_t _stats_nb_overflow;     // ... with a diff that overflowed
+	StatsVar _stats_uploadtime;      // bus time of the synchronous uploads (us)
+	StatsVar _stats_pixels;          // pixels uploaded per synchronous frame
+	StatsVar _stats_runs;            // runs per synchronous frame
+	StatsVar _stats_difftime;        // time to compute the diffs (us)
+	StatsVar _stats_diffsize;        // size of the diffs (bytes)
+	int _stats_last_pixels;          // pixels, runs and bus time (us) of the last _updateNow()
+	int _stats_last_runs;
+	uint32_t _stats_last_time;
+
+	bool _auto_gap;                  // true if the gap is set by _autoGap()
+	int _auto_gap_dir;               // direction of the last move (+1 or -1)
+	int _auto_gap_frames;            // frames accumulated in the current window
+	int _auto_gap_overflows;         // ... whose diff overflowed
+	float _auto_gap_cost;            // ... and their total bus cost (in pixels)
+	float _auto_gap_prev;            // average cost of the previous window (negative if none)
+
+	bool _interlace;                 // interlaced updates (see setInterlace())
+	bool _interlace_auto;            // ... uploaded progressively while the content is static
+	int _interlace_field;            // field of the next interlaced frame (0 = even rows, 1 = odd rows)
+	int _interlace_changed;          // pixels changed by the last differential frame (estimated)
+	int _field;                      // rows uploaded by _updateNow(): 0 = even, 1 = odd, -1 = all
+
+	/** record the statistics of a diff whose computation started at time start */
+	void _statsDiff(DiffBuffBase *diff, uint32_t start);
+
+	/** record a synchronous frame uploaded by _updateNow() / _pushFrameNow() (full = not a differential update) */
+	void _statsFrame(bool full);
+
+	/** feed the bus cost of the last differential frame to the gap controller */
+	void _autoGap(bool overflow);
+
+	/** rows of the next frame: the field to upload or -1 for all (diff: a diff tells the pixels changed) */
+	int _nextField(bool diff);
+
+	/** copy the rows of a field from fb into the mirror */
+	void _copyField(const uint16_t *fb, int field);
+
+	/***************************************************************************************************
+	 * Vsync engine
+	 ***************************************************************************************************/
+
+	TIM_HandleTypeDef *_htim;        // free running 1MHz timer (nullptr = no vsync).
+	GPIO_TypeDef *_te_port;          // GPIO port of the TE pin (nullptr = use GETSCANLINE).
+	uint16_t _te_pin;                // TE pin
+	volatile uint32_t _period;       // refresh period in us (0 = unknown).
+	uint32_t _synced_time;           // time of the last scanline synchronization.
+	int _synced_scanline;            // scanline at that time.
+	uint32_t _timeframestart;        // time at which the refresh displaying the last frame started.
+
+	/** true if the vsync engine is active */
+	bool _vsyncOn() const {
+		return ((_vsync_spacing > 0) && (_htim != nullptr) && (_period > 0));
+	}
+
+	/** current time in us */
+	uint32_t _micros() const {
+		return (_htim) ? __HAL_TIM_GET_COUNTER(_htim) : (HAL_GetTick() * 1000);
+	}
+
+	/**
+	 * Read the scanline from the panel (or the TE model) and resync the time model. 
+	 * The value returned is the gate line scaled to the diff rows [0, ILI9341_T4_NB_SCANLINES[, 
+	 * which only match the rows uploaded when _scanAligned(). 
+	 **/
+	int _getScanLine();
+
+	/**
+	 * Wait until the panel starts a new refresh and return the scanline at that point
+	 * or -1 on timeout. 
+	 **/
+	int _waitScanlineWrap();
+
+	/** measure the refresh period. */
+	void _sampleRefreshRate();
+
+	/**
+	 * true if the uploaded lines follow the gate lines in the scan order, i.e. if the scanline 
+	 * tells which diff rows the panel has already refreshed: hardware rotation in orientation 3. 
+	 * The 240 pixel rows are then sent on two gate lines each and diff row y (a run of the
+	 * framebuffer memory) lands on the gate lines around y * 320 / 240. Orientation 1 writes the 
+	 * rows against the scan (MADCTL MY) and orientations 0/2 (or software rotation) cross the gate 
+	 * lines with every line. 
+	 **/
+	bool _scanAligned() const {
+		return ((_rowsDoubled()) && (_rotation == 3));
+	}
+
+	/**
+	 * Wait until the next frame may start according to the vsync spacing and return the current 
+	 * scanline. With chase set (the upload follows the scanline, see _scanAligned()), the frame 
+	 * may start late according to the late start ratio. Otherwise it waits for the start of the 
+	 * refresh it is due for (or of the next one if that one has already started). 
+	 **/
+	int _waitFrameStart(bool chase = false);
+
+	DiffBuffBase *_diff1;                       // diff buffer used for differential updates.
+	uint16_t *_fb1;                  // internal framebuffer mirroring the screen (orientation 0). 
+	bool _fb1_valid;                 // true if _fb1 (or the signatures of diff1, see _sigDiff()) really match what is displayed on the screen. 
+	DiffBuffBase *_diff2;                       // second diff buffer, for merging region updates.
+	DiffBuffBase *_pending;          // changes stored in _fb1 but not drawn yet (nullptr if none).
+	DiffBuffDummy _dummydiff;        // pending changes when there is no room for a merged diff.
+	int _pending_begin, _pending_end; // lines [begin, end[ of _fb1 covered by _dummydiff.
+
+	/** draw the changes stored in the internal framebuffer (if any). */
+	void _flushPending();
+
+	/**
+	 * Clip a region (w.r.t. the current rotation) to the screen, moving sub_fb accordingly.
+	 * Return false if nothing is left. 
+	 **/
+	bool _clipRegion(const uint16_t *&sub_fb, int &xmin, int &xmax, int &ymin,
+			int &ymax, int stride) const;
 
 	/**
 	 * Update part of the screen using a diff buffer object representing the changes between
-	 * the old framebuffer and the new one 'fb'.
+	 * the old framebuffer and the new one 'fb' (in orientation 'fb_orientation').
 	 * - return only when update completed.
 	 * - uses the _vsync_spacing parameter to choose the vsync stategy.
 	 **/
-	void _updateNow(const uint16_t *fb, DiffBuffBase *diff);
+	void _updateNow(const uint16_t *fb, int fb_orientation,
+			DiffBuffBase *diff);
+
+	/** same as _updateNow() for a diff made of rectangles (see DiffBuffBase::rectangles()) */
+	void _updateRectsNow(const uint16_t *fb, int fb_orientation,
+			DiffBuffBase *diff);
 
 	/**
-	 * Update a rectangular region of the screen directly.
+	 * Update a rectangular region of the screen directly (w.r.t. the current rotation, already clipped).
+	 * single window for the whole region
 	 * no diff buffer (the whole region is updated)
 	 * no vsync (i.e. as fast as possible)
 	 * no dma.
@@ -514,12 +1273,14 @@ private:
 	void _updateRectNow(const uint16_t *sub_fb, int xmin, int xmax, int ymin,
 			int ymax, int stride);
 
+	/** Fill a rectangular region of the screen (w.r.t. the current rotation) with a single color. */
 	void _pushRect(uint16_t color, int xmin, int xmax, int ymin, int ymax);
 
-	void _pushpixels(const uint16_t *fb, int x, int y, int len)
+	void _pushpixels(const uint16_t *fb, int fb_orientation, int x, int y,
+			int len)
 			ILI9341_T4_ALWAYS_INLINE
 			{
-		switch (_rotation) {
+		switch (fb_orientation) {
 		case 0:
 			_pushpixels_mode0(fb, x, y, len);
 			return;
@@ -536,6 +1297,18 @@ private:
 		// hum...
 	}
 
+	/**
+	 * Push a full framebuffer given in the panel order (orientation _fbOrientation(), e.g. the
+	 * internal framebuffer) with a single window. 
+	 **/
+	void _pushFrameNow(const uint16_t *fb);
+
+	/**
+	 * Push the run of len pixels starting at linear offset off of a framebuffer whose rows are 
+	 * doubled (see _rowsDoubled()). 
+	 **/
+	void _pushRun(const uint16_t *fb, int off, int len);
+
 	void _pushpixels_mode0(const uint16_t *fb, int x, int y, int len);
 
 	void _pushpixels_mode1(const uint16_t *fb, int x, int y, int len);
@@ -544,6 +1317,53 @@ private:
 
 	void _pushpixels_mode3(const uint16_t *fb, int x, int y, int len);
 
+	/**
+	 * Push len framebuffer pixels, each one doubled horizontally. Each doubled pair is emitted
+	 * as a single 32 bit store which the FSMC splits in two 16 bit bus cycles. Pixels are read
+	 * two at a time when src is word aligned.
+	 **/
+	static void _pushpixels_x2(const uint16_t *src, int len)
+			ILI9341_T4_ALWAYS_INLINE
+			{
+		if ((((uintptr_t) src) & 3) && (len > 0)) {
+			const uint32_t c = *src++;
+			LCD_DataWrite32(c | (c << 16));
+			len--;
+		}
+		const uint32_t *p = (const uint32_t*) src;
+		while (len >= 2) {
+			const uint32_t w = *p++;
+			LCD_DataWrite32((w << 16) | (w & 0xFFFF));
+			LCD_DataWrite32((w >> 16) | (w & 0xFFFF0000));
+			len -= 2;
+		}
+		if (len > 0) {
+			const uint32_t c = *((const uint16_t*) p);
+			LCD_DataWrite32(c | (c << 16));
+		}
+	}
+
+	/**
+	 * Push len framebuffer pixels as they are, two at a time with a single 32 bit store when src 
+	 * is word aligned.
+	 **/
+	static void _pushpixels_x1(const uint16_t *src, int len)
+			ILI9341_T4_ALWAYS_INLINE
+			{
+		if ((((uintptr_t) src) & 3) && (len > 0)) {
+			LCD_DataWrite(*src++);
+			len--;
+		}
+		const uint32_t *p = (const uint32_t*) src;
+		while (len >= 2) {
+			LCD_DataWrite32(*p++); // low half (first pixel) goes out first.
+			len -= 2;
+		}
+		if (len > 0) {
+			LCD_DataWrite(*((const uint16_t*) p));
+		}
+	}
+
 	/** clip val to [min,max] */
 	template<typename T> static T _clip(T val, T min, T max) {
 		if (val < min)
@@ -553,6 +1373,88 @@ private:
 		return val;
 	}
 
+	/**********************************************************************************************************
+	 * DMA
+	 ***********************************************************************************************************/
+
+	DMA_HandleTypeDef *_hdma;                       // DMA stream used for async updates (or nullptr).
+	const uint16_t *volatile _dma_fb;               // framebuffer currently uploaded.
+	volatile int _dma_line;          // next framebuffer line to send (already expanded in its line buffer).
+	int _dma_nblines;                // number of transfers making up the upload.
+	volatile bool _dma_busy;                        // true while an async upload is ongoing.
+	int _dma_linelen;                  // number of dma transfers per line (depends on the stream data width).
+	bool _dma_word;                    // true if the stream moves words (pixel pairs) rather than half-words.
+	volatile bool _dma_rows;           // true if the upload streams each framebuffer row twice (see _rowsDoubled()).
+
+	callback_t _upload_cb;                          // called (from the irq) when an upload completes.
+	void *_upload_cb_param;                         //
+
+	uint32_t _dma_linebuf[2][ILI9341_FB_PIXEL_WIDTH]; // ping-pong buffers holding expanded lines (1 word = 1 doubled pixel). 
+
+	const uint16_t *_palette;                       // palette for indexed uploads (or nullptr).
+	/** a piece of a differential upload held in a line buffer */
+	struct DmaChunk {
+		int n;                  // number of (framebuffer) pixels, 0 = end of the diff.
+		bool win;               // true if it starts a diff instruction: the window must be set first.
+		int x, y, w;            // that window: columns [x, x + w - 1] from line y down.
+	};
+
+	DiffBuffBase *volatile _dma_diff;               // diff walked by the irq (nullptr if the upload is not differential).
+	DmaChunk _dma_chunk[2];                         // pieces held in each line buffer.
+	int _dma_cur;                                   // line buffer being sent.
+	int _dma_rx, _dma_rw;                           // columns of the current diff instruction.
+	int _dma_cx, _dma_cy;                           // next pixel of the instruction to prepare.
+	int _dma_left;                                  // pixels of the instruction not prepared yet.
+	uint32_t _dma_t0;                               // start time, pixels and runs of the upload (for the statistics).
+	int _dma_pixels, _dma_runs;
+
+	const uint8_t *volatile _dma_fb8;               // indexed framebuffer currently uploaded (or nullptr).
+	int _dma_srclen;                                // number of indices per indexed framebuffer row.
+	int _dma_rowshift;                              // line l sends indexed row l >> _dma_rowshift.
+	bool _dma_double;                               // true if the indexed pixels are doubled.
+
+	const uint16_t *volatile _dma_fbs;              // scaled framebuffer currently uploaded (or nullptr).
+	int _dma_sx;                                    // its horizontal replication (rows: _dma_rowshift, length: _dma_srclen).
+
+	static ILI9341Driver *_dmaObject;               // object currently using the DMA (for the static callbacks).
+
+	/** expand a (word aligned) framebuffer line to the physical screen width */
+	static void _expandLine(uint32_t *dst, const uint16_t *src);
+
+	/** set up the indexed upload of fb (lines, expansion, window) */
+	bool _setupIndexed(const uint8_t *fb, bool native);
+
+	/** expand line 'line' of the indexed upload through the palette */
+	void _expandLine8(uint32_t *dst, int line);
+
+	/** set up the scaled upload of fb (lines, expansion) */
+	void _setupScaled(const uint16_t *fb, int mode);
+
+	/** expand line 'line' of the scaled upload to the native width */
+	void _expandLineScaled(uint32_t *dst, int line);
+
+	/** expand n pixels (doubling them) in a line buffer */
+	static void _expandRun(uint32_t *dst, const uint16_t *src, int n);
+
+	/** start uploading diff with the dma, reading the pixels from fb (orientation 0) */
+	void _dmaDiffStart(const uint16_t *fb, DiffBuffBase *diff);
+
+	/** read the next piece of the diff (at most a line buffer) into line buffer b */
+	void _dmaDiffPrepare(int b);
+
+	/** send the piece prepared in the other line buffer (and refill this one) or terminate the upload */
+	void _dmaDiffNext();
+
+	/** called from the DMA transfer complete irq: send the next line or terminate the upload */
+	void _dmaNextLine();
+
+	/** terminate the upload (called from the irq) */
+	void _dmaEnd();
+
+	static void _dmaXferCpltStatic(DMA_HandleTypeDef *hdma);
+
+	static void _dmaXferErrorStatic(DMA_HandleTypeDef *hdma);
+
 	/**********************************************************************************************************
 	 * Drawing characters
 	 * (adapted from the tgx library)
@@ -1,61 +1,213 @@
 #pragma once
 
+#include "DiffBuff.h"
+#include "DisplayList.h"
+
 /**
  * Minimal wrapper for the ILI9341Driver class that implement the
  * needed drawing primitives (line / circle / rectangle...). 
+ * 
+ * The buffer may also hold only a band of lines of the (lx, ly) screen 
+ * (see setBand()): drawing is then clipped to the band and coordinates 
+ * stay screen coordinates. 
+ * 
+ * color_t is the pixel type: uint16_t for RGB565 framebuffers or uint8_t for 
+ * indexed ones (one byte per pixel, expanded through a palette on upload). 
+ * 
+ * Damage tracking (see setDamage()) records the bounding box of every primitive 
+ * drawn so that ILI9341Driver::updateDamage() uploads only what was drawn. 
+ * 
+ * In recording mode (see setRecord()), the primitives are appended to a display 
+ * list instead of being drawn, to be replayed later (e.g. once per band). 
  **/
-class ILI9341Wrapper {
+template<typename color_t> class ILI9341WrapperT {
 
 public:
 
-	ILI9341Wrapper(uint16_t *fb, int lx, int ly) {
+	ILI9341WrapperT(color_t *fb, int lx, int ly) {
 		_buffer = fb;
 		_lx = lx;
 		_ly = ly;
 		_stride = lx;
+		_y0 = 0;
+		_y1 = ly;
+		_dmg = nullptr;
+		_dmg_orientation = 0;
+		_dmg_lock = 0;
+		_rec = nullptr;
+	}
+
+	/**
+	 * Recording mode: from now on, the primitives are appended to dl instead of being drawn
+	 * (nullptr to draw again). Nothing reaches the buffer meanwhile, so readPixel() does not see
+	 * the recorded primitives: its result is undefined (0 during BandRenderer::renderRecorded(),
+	 * which records with an empty band).
+	 **/
+	void setRecord(DisplayList *dl) {
+		_rec = dl;
+	}
+
+	DisplayList* record() const {
+		return _rec;
+	}
+
+	/**
+	 * Draw the commands of dl (as if the primitives were called again). With a band set, the 
+	 * commands outside of it are skipped without being decoded. 
+	 **/
+	void replay(const DisplayList &dl) {
+		const int16_t *p = dl.data();
+		const int16_t *const end = p + dl.size();
+		while (p < end) {
+			const int op = p[0];
+			const bool inband = (p[2] >= _y0) && (p[1] < _y1);
+			const int16_t *a = p + 3;
+			p = a + DisplayList::nbArgs(op);
+			if (!inband)
+				continue;
+			switch (op & DisplayList::OP_MASK) {
+			case DisplayList::OP_PIXEL:
+				drawPixel(a[0], a[1], (color_t) a[2]);
+				break;
+			case DisplayList::OP_HLINE:
+				drawFastHLine(a[0], a[1], a[2], (color_t) a[3]);
+				break;
+			case DisplayList::OP_VLINE:
+				drawFastVLine(a[0], a[1], a[2], (color_t) a[3]);
+				break;
+			case DisplayList::OP_FILLRECT:
+				fillRect(a[0], a[1], a[2], a[3], (color_t) a[4]);
+				break;
+			case DisplayList::OP_RECT:
+				drawRect(a[0], a[1], a[2], a[3], (color_t) a[4]);
+				break;
+			case DisplayList::OP_LINE:
+				drawLine(a[0], a[1], a[2], a[3], (color_t) a[4]);
+				break;
+			case DisplayList::OP_TRIANGLE:
+				drawFilledTriangle(a[0], a[1], a[2], a[3], a[4], a[5],
+						(color_t) a[6]);
+				break;
+			case DisplayList::OP_CIRCLE:
+				if ((op & DisplayList::OP_OUTLINE) && (op & DisplayList::OP_FILL))
+					drawFilledCircle<true, true>(a[0], a[1], a[2], (color_t) a[3],
+							(color_t) a[4]);
+				else if (op & DisplayList::OP_OUTLINE)
+					drawFilledCircle<true, false>(a[0], a[1], a[2],
+							(color_t) a[3], (color_t) a[4]);
+				else if (op & DisplayList::OP_FILL)
+					drawFilledCircle<false, true>(a[0], a[1], a[2],
+							(color_t) a[3], (color_t) a[4]);
+				break;
+			}
+		}
+	}
+
+	/**
+	 * Record the (clipped) bounding box of every primitive drawn from now on into damage, 
+	 * nullptr to stop. orientation is the one of the framebuffer w.r.t. the panel (the driver 
+	 * rotation when it rotates in software, 0 otherwise). The driver clears the damage when it 
+	 * uploads it (see ILI9341Driver::updateDamage()). 
+	 **/
+	void setDamage(ILI9341_T4::DiffBuffRect *damage, int orientation = 0) {
+		_dmg = damage;
+		_dmg_orientation = orientation;
+	}
+
+	ILI9341_T4::DiffBuffRect* damage() const {
+		return _dmg;
 	}
 
-	inline void drawPixel(int x, int y, uint16_t color) {
-		if ((x < 0) || (y < 0) || (x >= _lx) || (y >= _ly))
+	/**
+	 * Draw into a band buffer holding lines [y0, y0 + nblines[ of the screen
+	 * (with stride lx). 
+	 **/
+	void setBand(color_t *buf, int y0, int nblines) {
+		_buffer = buf - y0 * _stride; // so that screen coordinates index it directly.
+		_y0 = (y0 < 0) ? 0 : y0;
+		_y1 = (y0 + nblines > _ly) ? _ly : (y0 + nblines);
+	}
+
+	/** first screen line held by the buffer */
+	int bandStart() const {
+		return _y0;
+	}
+
+	/** one past the last screen line held by the buffer */
+	int bandEnd() const {
+		return _y1;
+	}
+
+	inline void drawPixel(int x, int y, color_t color) {
+		if (_rec) {
+			const int args[] = { x, y, color };
+			_rec->push(DisplayList::OP_PIXEL, y, y, args, 3);
 			return;
+		}
+		if ((x < 0) || (y < _y0) || (x >= _lx) || (y >= _y1))
+			return;
+		_damage(x, x, y, y);
 		_buffer[x + _stride * y] = color;
 	}
 
-	inline uint16_t readPixel(int x, int y) {
-		if ((x < 0) || (y < 0) || (x >= _lx) || (y >= _ly))
+	inline color_t readPixel(int x, int y) {
+		if ((x < 0) || (y < _y0) || (x >= _lx) || (y >= _y1))
 			return 0;
 		return _buffer[x + _stride * y];
 	}
 
-	void fillScreen(uint16_t color) {
+	void fillScreen(color_t color) {
 		fillRect(0, 0, _lx, _ly, color);
 	}
 
-	void fillRect(int x, int y, int w, int h, uint16_t color) {
+	void fillRect(int x, int y, int w, int h, color_t color) {
+		if (_rec) {
+			const int args[] = { x, y, w, h, color };
+			_rec->push(DisplayList::OP_FILLRECT, y, y + h - 1, args, 5);
+			return;
+		}
+		DamageScope ds(*this, x, x + w - 1, y, y + h - 1);
+		if (y < _y0) {
+			h -= _y0 - y;
+			y = _y0;
+		}
+		if (y + h > _y1)
+			h = _y1 - y;
 		for (int j = y; j < y + h; j++) {
 			drawFastHLine(x, j, w, color);
 		}
 	}
 
-	inline void drawFastVLine(int x, int y, int h, uint16_t color) {
-		if ((x < 0) || (x >= _lx) || (y >= _ly))
+	inline void drawFastVLine(int x, int y, int h, color_t color) {
+		if (_rec) {
+			const int args[] = { x, y, h, color };
+			_rec->push(DisplayList::OP_VLINE, y, y + h - 1, args, 4);
 			return;
-		if (y < 0) {
-			h += y;
-			y = 0;
 		}
-		if (y + h > _ly) {
-			h = _ly - y;
+		if ((x < 0) || (x >= _lx) || (y >= _y1))
+			return;
+		if (y < _y0) {
+			h -= _y0 - y;
+			y = _y0;
 		}
-		uint16_t *p = _buffer + x + y * _stride;
+		if (y + h > _y1) {
+			h = _y1 - y;
+		}
+		_damage(x, x, y, y + h - 1);
+		color_t *p = _buffer + x + y * _stride;
 		while (h-- > 0) {
 			(*p) = color;
 			p += _stride;
 		}
 	}
 
-	inline void drawFastHLine(int x, int y, int w, uint16_t color) {
-		if ((y < 0) || (y >= _ly) || (x >= _lx))
+	inline void drawFastHLine(int x, int y, int w, color_t color) {
+		if (_rec) {
+			const int args[] = { x, y, w, color };
+			_rec->push(DisplayList::OP_HLINE, y, y, args, 4);
+			return;
+		}
+		if ((y < _y0) || (y >= _y1) || (x >= _lx))
 			return;
 		if (x < 0) {
 			w += x;
@@ -64,14 +216,15 @@ public:
 		if (x + w > _lx) {
 			w = _lx - x;
 		}
-		uint16_t *p = _buffer + x + y * _stride;
+		_damage(x, x + w - 1, y, y);
+		color_t *p = _buffer + x + y * _stride;
 		while (w-- > 0) {
 			(*p) = color;
 			p++;
 		}
 	}
 
-	inline void drawHLine(int a, int b, int y, uint16_t color) {
+	inline void drawHLine(int a, int b, int y, color_t color) {
 		if (b > a) {
 			drawFastHLine(a, y, b - a, color);
 		} else {
@@ -79,7 +232,7 @@ public:
 		}
 	}
 
-	inline void drawVLine(int a, int b, int x, uint16_t color) {
+	inline void drawVLine(int a, int b, int x, color_t color) {
 		if (b > a) {
 			drawFastVLine(a, x, b - a, color);
 		} else {
@@ -87,7 +240,13 @@ public:
 		}
 	}
 	inline void drawFilledTriangle(int16_t x0, int16_t y0, int16_t x1,
-			int16_t y1, int16_t x2, int16_t y2, uint16_t color) {
+			int16_t y1, int16_t x2, int16_t y2, color_t color) {
+		if (_rec) {
+			const int args[] = { x0, y0, x1, y1, x2, y2, color };
+			_rec->push(DisplayList::OP_TRIANGLE, min3(y0, y1, y2),
+					max3(y0, y1, y2), args, 7);
+			return;
+		}
 		// Sort the y-coordinates in ascending order
 		if (y0 > y1) {
 			swap(y0, y1);
@@ -101,6 +260,9 @@ public:
 			swap(y0, y1);
 			swap(x0, x1);
 		}
+		if ((y2 < _y0) || (y0 >= _y1))
+			return; // not in the band.
+		DamageScope ds(*this, min3(x0, x1, x2), max3(x0, x1, x2), y0, y2);
 
 		// Calculate the slope and y-intercept for each line
 		int16_t m1 = (x1 - x0) * 256 / (y1 - y0 + 1);
@@ -111,7 +273,10 @@ public:
 		// Draw the horizontal lines between the pairs of points with the same y value
 		int16_t curx1 = x0;
 		int16_t curx2 = x0;
-		for (int16_t scanlineY = y0; scanlineY <= y1; scanlineY++) {
+		const int16_t ya = (y0 > _y0) ? y0 : _y0; // only the lines of the band
+		const int16_t yb = (y2 < _y1) ? y2 : (_y1 - 1);
+		for (int16_t scanlineY = ya; scanlineY <= y1 && scanlineY <= yb;
+				scanlineY++) {
 			curx1 = m1 * scanlineY / 256 + b1;
 			curx2 = m2 * scanlineY / 256 + b2;
 			drawHLine(curx1, curx2, scanlineY, color);
@@ -119,21 +284,39 @@ public:
 
 		m1 = (x2 - x1) * 256 / (y2 - y1 + 1);
 		b1 = x1 - m1 * y1 / 256;
-		for (int16_t scanlineY = y1; scanlineY <= y2; scanlineY++) {
+		for (int16_t scanlineY = (y1 > ya) ? y1 : ya; scanlineY <= yb;
+				scanlineY++) {
 			curx1 = m1 * scanlineY / 256 + b1;
 			curx2 = m2 * scanlineY / 256 + b2;
 			drawHLine(curx1, curx2, scanlineY, color);
 		}
 	}
 
-	inline void drawRect(int x, int y, int w, int h, uint16_t color) {
+	inline void drawRect(int x, int y, int w, int h, color_t color) {
+		if (_rec) {
+			const int args[] = { x, y, w, h, color };
+			_rec->push(DisplayList::OP_RECT, (h > 0) ? y : (y + h - 1),
+					(h > 0) ? (y + h - 1) : y, args, 5);
+			return;
+		}
+		// (the sides are still drawn at x + w - 1 and y + h - 1 when w or h is not positive)
+		DamageScope ds(*this, (w > 0) ? x : (x + w - 1), (w > 0) ? (x + w - 1) : x,
+				(h > 0) ? y : (y + h - 1), (h > 0) ? (y + h - 1) : y);
 		drawFastHLine(x, y, w, color);
 		drawFastHLine(x, y + h - 1, w, color);
 		drawFastVLine(x, y, h, color);
 		drawFastVLine(x + w - 1, y, h, color);
 	}
 
-	void drawLine(int x0, int y0, int x1, int y1, uint16_t color) {
+	void drawLine(int x0, int y0, int x1, int y1, color_t color) {
+		if (_rec) {
+			const int args[] = { x0, y0, x1, y1, color };
+			_rec->push(DisplayList::OP_LINE, (y0 < y1) ? y0 : y1,
+					(y0 < y1) ? y1 : y0, args, 5);
+			return;
+		}
+		DamageScope ds(*this, (x0 < x1) ? x0 : x1, (x0 < x1) ? x1 : x0,
+				(y0 < y1) ? y0 : y1, (y0 < y1) ? y1 : y0);
 		if (y0 == y1) {
 			if (x1 > x0) {
 				drawFastHLine(x0, y0, x1 - x0 + 1, color);
@@ -215,15 +398,24 @@ public:
 	}
 
 	template<bool OUTLINE, bool FILL> void drawFilledCircle(int xm, int ym,
-			int r, uint16_t color, uint16_t fillcolor) {
+			int r, color_t color, color_t fillcolor) {
 		if (r <= 0)
 			return;
+		if (_rec) {
+			const int args[] = { xm, ym, r, color, fillcolor };
+			_rec->push(
+					DisplayList::OP_CIRCLE | (OUTLINE ? DisplayList::OP_OUTLINE : 0)
+							| (FILL ? DisplayList::OP_FILL : 0), ym - r, ym + r,
+					args, 5);
+			return;
+		}
 		if (r > 2) { // circle is large enough to check first if there is something to draw.
-			if ((xm + r < 0) || (xm - r >= _lx) || (ym + r < 0)
-					|| (ym - r >= _ly))
+			if ((xm + r < 0) || (xm - r >= _lx) || (ym + r < _y0)
+					|| (ym - r >= _y1))
 				return; // outside of image. 
 			// TODO : check if the circle completely fills the image, in this case use FillScreen()
 		}
+		DamageScope ds(*this, xm - r, xm + r, ym - r, ym + r);
 		switch (r) {
 		case 0: {
 			if (OUTLINE) {
@@ -282,9 +474,62 @@ private:
 		b = c;
 	}
 
-	uint16_t *_buffer;
+	inline static int min3(int a, int b, int c) {
+		return (a < b) ? ((a < c) ? a : c) : ((b < c) ? b : c);
+	}
+
+	inline static int max3(int a, int b, int c) {
+		return (a > b) ? ((a > c) ? a : c) : ((b > c) ? b : c);
+	}
+
+	/** add the box [xmin,xmax]x[ymin,ymax] (clipped to the buffer) to the damage */
+	inline void _damage(int xmin, int xmax, int ymin, int ymax) {
+		if ((_dmg == nullptr) || (_dmg_lock > 0))
+			return; // not tracking, or an enclosing primitive recorded its box.
+		if (xmin < 0)
+			xmin = 0;
+		if (xmax >= _lx)
+			xmax = _lx - 1;
+		if (ymin < _y0)
+			ymin = _y0;
+		if (ymax >= _y1)
+			ymax = _y1 - 1;
+		if ((xmin <= xmax) && (ymin <= ymax))
+			_dmg->addRect(xmin, xmax, ymin, ymax, _dmg_orientation);
+	}
+
+	/** record the box of a primitive and mute the damage of the primitives it draws with */
+	class DamageScope {
+	public:
+		DamageScope(ILI9341WrapperT &w, int xmin, int xmax, int ymin, int ymax) :
+				_w(w) {
+			_w._damage(xmin, xmax, ymin, ymax);
+			_w._dmg_lock++;
+		}
+		~DamageScope() {
+			_w._dmg_lock--;
+		}
+	private:
+		ILI9341WrapperT &_w;
+	};
+
+	color_t *_buffer;
 	int _lx;
 	int _ly;
 	int _stride;
+	int _y0;    // lines [_y0, _y1[ are held in the buffer
+	int _y1;    //
+
+	ILI9341_T4::DiffBuffRect *_dmg; // damage tracking (nullptr if off)
+	int _dmg_orientation;
+	int _dmg_lock;                  // > 0 while a primitive draws with other primitives
+
+	DisplayList *_rec;              // recording mode (nullptr if off)
 
 };
+
+/** RGB565 framebuffer */
+typedef ILI9341WrapperT<uint16_t> ILI9341Wrapper;
+
+/** indexed framebuffer: the colors are palette indices (see ILI9341Driver::setPalette()) */
+typedef ILI9341WrapperT<uint8_t> ILI9341Wrapper8;
@@ -0,0 +1,151 @@
+/******************************************************************************
+ *  ILI9341_T4 library for driving an ILI9341 screen via SPI with a Teensy 4/4.1
+ *  Implements vsync and differential updates from a memory framebuffer.
+ *
+ *  Copyright (c) 2020 Arvind Singh.  All right reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *******************************************************************************/
+
+#ifndef _II9341_T4_SCALECONTROLLER_H_
+#define _II9341_T4_SCALECONTROLLER_H_
+
+// only C++, no plain C
+#ifdef __cplusplus
+
+#include <cstdint>
+#include "ILI9341Driver.h"
+
+namespace ILI9341_T4 {
+
+/******************************************************************************************
+ * Choose the scale mode of scaled uploads (see ILI9341Driver::updateScaled()) from the
+ * measured render time so that a frame renders within the budget of a target frame rate.
+ *
+ * The render time is assumed proportional to the number of pixels drawn: the cost per
+ * pixel is averaged over the last frames and the finest mode whose predicted time fits in
+ * the budget is selected. Switching to a finer mode requires some headroom and every change
+ * is held for a few frames so that the resolution does not flicker between two modes.
+ *******************************************************************************************/
+class ScaleController {
+
+public:
+
+	static const int HOLD_FRAMES = 8;       // frames kept in a mode after a change.
+	static constexpr float HEADROOM = 0.8f; // fraction of the budget a finer mode may use.
+	static constexpr float SMOOTHING = 0.25f; // weight of the last frame in the average cost.
+
+	/**
+	 * Constructor. Modes from finest to coarsest are allowed (the buffer must hold a
+	 * framebuffer of the finest one) and the controller starts with the coarsest.
+	 **/
+	ScaleController(float target_fps = 30.0f, int finest =
+			ILI9341Driver::SCALE_2X1, int coarsest = ILI9341Driver::SCALE_4X4) {
+		setTargetFPS(target_fps);
+		setRange(finest, coarsest);
+	}
+
+	/** set the frame rate to reach (frames per second) */
+	void setTargetFPS(float fps) {
+		_budget = (fps > 0.0f) ? (1000000.0f / fps) : 1000000.0f;
+	}
+
+	/** frame budget in microseconds */
+	float budget() const {
+		return _budget;
+	}
+
+	/** set the allowed modes and restart from the coarsest */
+	void setRange(int finest, int coarsest) {
+		if (finest < ILI9341Driver::SCALE_1X1)
+			finest = ILI9341Driver::SCALE_1X1;
+		if (coarsest > ILI9341Driver::SCALE_4X4)
+			coarsest = ILI9341Driver::SCALE_4X4;
+		if (coarsest < finest)
+			coarsest = finest;
+		_finest = finest;
+		_coarsest = coarsest;
+		reset();
+	}
+
+	int finest() const {
+		return _finest;
+	}
+
+	int coarsest() const {
+		return _coarsest;
+	}
+
+	/** forget the measurements and restart from the coarsest mode */
+	void reset() {
+		_mode = _coarsest;
+		_cost = 0.0f;
+		_hold = 0;
+	}
+
+	/** mode to render the next frame with */
+	int mode() const {
+		return _mode;
+	}
+
+	/** predicted render time (us) of a frame in a given mode */
+	float predicted(int mode) const {
+		return _cost * (float) nbPixels(mode);
+	}
+
+	/**
+	 * Report the render time (us) of the frame rendered in mode() and return the mode for
+	 * the next one.
+	 **/
+	int update(uint32_t render_us) {
+		const float c = ((float) render_us) / ((float) nbPixels(_mode));
+		_cost = (_cost > 0.0f) ? (_cost + SMOOTHING * (c - _cost)) : c;
+		if (_hold > 0) {
+			_hold--;
+			return _mode;
+		}
+		int m = _finest;
+		while ((m < _coarsest)
+				&& (predicted(m) > ((m < _mode) ? (HEADROOM * _budget) : _budget)))
+			m++;
+		if (m != _mode) {
+			_mode = m;
+			_hold = HOLD_FRAMES;
+		}
+		return _mode;
+	}
+
+	/** number of pixels of a framebuffer in a given mode (native 320x240 screen) */
+	static int nbPixels(int mode) {
+		return (ILI9341_PHY_PIXEL_WIDTH * ILI9341_PHY_PIXEL_HEIGHT)
+				/ (ILI9341Driver::scaleX(mode) * ILI9341Driver::scaleY(mode));
+	}
+
+private:
+
+	float _budget;  // frame budget (us)
+	int _finest;    // allowed modes
+	int _coarsest;  //
+	int _mode;      // current mode
+	float _cost;    // average render time per pixel (us)
+	int _hold;      // frames left before the mode may change again
+
+};
+
+}
+
+#endif
+
+#endif
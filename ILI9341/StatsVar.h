@@ -0,0 +1,124 @@
+/******************************************************************************
+ *  ILI9341_T4 library for driving an ILI9341 screen via SPI with a Teensy 4/4.1
+ *  Implements vsync and differential updates from a memory framebuffer.
+ *
+ *  Copyright (c) 2020 Arvind Singh.  All right reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *******************************************************************************/
+
+#ifndef _II9341_T4_STATSVAR_H_
+#define _II9341_T4_STATSVAR_H_
+
+// only C++, no plain C
+#ifdef __cplusplus
+
+#include <math.h>
+#include <cstdint>
+#include <cstdio>
+
+namespace ILI9341_T4 {
+
+/******************************************************************************************
+ * Running statistics (count, min, max, mean and standard deviation) of a variable.
+ *
+ * Values are pushed one at a time and nothing is stored: the mean and variance are updated
+ * with Welford's method which stays accurate in single precision (no double on the M4 FPU).
+ *******************************************************************************************/
+class StatsVar {
+
+public:
+
+	StatsVar() {
+		reset();
+	}
+
+	/** forget all the values pushed so far */
+	void reset() {
+		_count = 0;
+		_min = 0.0f;
+		_max = 0.0f;
+		_avg = 0.0f;
+		_m2 = 0.0f;
+	}
+
+	/** add a value */
+	void push(float val) {
+		_count++;
+		if ((_count == 1) || (val < _min))
+			_min = val;
+		if ((_count == 1) || (val > _max))
+			_max = val;
+		const float d = val - _avg;
+		_avg += d / _count;
+		_m2 += d * (val - _avg);
+	}
+
+	/** number of values pushed */
+	uint32_t count() const {
+		return _count;
+	}
+
+	/** smallest value (0 if empty) */
+	float min() const {
+		return _min;
+	}
+
+	/** largest value (0 if empty) */
+	float max() const {
+		return _max;
+	}
+
+	/** mean value (0 if empty) */
+	float avg() const {
+		return _avg;
+	}
+
+	/** standard deviation (0 with less than 2 values) */
+	float std() const {
+		return (_count > 1) ? sqrtf(_m2 / (_count - 1)) : 0.0f;
+	}
+
+	/**
+	 * Print the statistics as "avg unit [min - max] std=..." followed by endl.
+	 * Set int_only to print the values without decimals.
+	 **/
+	void print(const char *unit = "", const char *endl = "\n",
+			bool int_only = false) const {
+		if (int_only)
+			printf("%d%s [%d - %d] std=%d%s", (int) lroundf(avg()), unit,
+					(int) lroundf(min()), (int) lroundf(max()),
+					(int) lroundf(std()), endl);
+		else
+			printf("%.2f%s [%.2f - %.2f] std=%.2f%s", (double) avg(), unit,
+					(double) min(), (double) max(), (double) std(), endl);
+	}
+
+private:
+
+	uint32_t _count;    // number of values
+	float _min, _max;   // extreme values
+	float _avg;         // running mean
+	float _m2;          // running sum of squared deviations from the mean
+
+};
+
+}
+
+#endif
+
+#endif
+
+/** end of file */
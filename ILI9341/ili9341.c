@@ -21,6 +21,17 @@ static unsigned char lcdLandscapeConfig = 0;
 static unsigned char lcdPortraitMirrorConfig = 0;
 static unsigned char lcdLandscapeMirrorConfig = 0;
 
+// Last address window sent to the controller and, when known, the position of the
+// write pointer in it (see lcdAdvanceWritePointer()). lcdSetWindow() only sends the
+// fields which changed, or nothing but WRITEMEMCONTINUE when a run continues at the
+// current position.
+static struct {
+	bool valid;         // x0..y1 hold the controller CASET/PASET values
+	bool ptrValid;      // px, py hold the position of the next pixel written
+	unsigned short x0, y0, x1, y1;
+	unsigned short px, py;
+} lcdWindow = { false, false, 0, 0, 0, 0, 0, 0 };
+
 static void lcdReset(void);
 static void lcdWriteCommand(unsigned char command);
 static void lcdWriteData(unsigned short data);
@@ -173,6 +184,7 @@ void lcdInit(void) {
 	lcdWriteData(0x3A);
 	lcdWriteData(0x1F);
 
+	lcdInvalidateWindow();
 	lcdWriteCommand(ILI9341_COLADDRSET);
 	lcdWriteData(0x00);
 	lcdWriteData(0x00);
@@ -209,6 +221,7 @@ void lcdHome(void) {
 
 void lcdSetOrientation(lcdOrientationTypeDef value) {
 	lcdProperties.orientation = value;
+	lcdInvalidateWindow(); // resend the whole window in the new addressing.
 	lcdWriteCommand(ILI9341_MEMCONTROL);
 
 	switch (lcdProperties.orientation) {
@@ -258,19 +271,77 @@ void lcdSetCursor(unsigned short x, unsigned short y) {
  */
 void lcdSetWindow(unsigned short x0, unsigned short y0, unsigned short x1,
 		unsigned short y1) {
-	lcdWriteCommand(ILI9341_COLADDRSET);
-	lcdWriteData((x0 >> 8) & 0xFF);
-	lcdWriteData(x0 & 0xFF);
-	lcdWriteData((x1 >> 8) & 0xFF);
-	lcdWriteData(x1 & 0xFF);
-	lcdWriteCommand(ILI9341_PAGEADDRSET);
-	lcdWriteData((y0 >> 8) & 0xFF);
-	lcdWriteData(y0 & 0xFF);
-	lcdWriteData((y1 >> 8) & 0xFF);
-	lcdWriteData(y1 & 0xFF);
+	if ((lcdWindow.ptrValid) && (x0 == lcdWindow.px) && (y0 == lcdWindow.py)
+			&& (x0 == lcdWindow.x0) && (x1 == lcdWindow.x1)
+			&& (y1 == lcdWindow.y1)) {
+		// the pointer is already there and wraps to the same column: just keep on writing.
+		lcdWindow.ptrValid = false;
+		lcdWriteCommand(ILI9341_WRITEMEMCONTINUE);
+		return;
+	}
+	if ((!lcdWindow.valid) || (x0 != lcdWindow.x0) || (x1 != lcdWindow.x1)) {
+		lcdWriteCommand(ILI9341_COLADDRSET);
+		lcdWriteData((x0 >> 8) & 0xFF);
+		lcdWriteData(x0 & 0xFF);
+		lcdWriteData((x1 >> 8) & 0xFF);
+		lcdWriteData(x1 & 0xFF);
+		lcdWindow.x0 = x0;
+		lcdWindow.x1 = x1;
+	}
+	if ((!lcdWindow.valid) || (y0 != lcdWindow.y0) || (y1 != lcdWindow.y1)) {
+		lcdWriteCommand(ILI9341_PAGEADDRSET);
+		lcdWriteData((y0 >> 8) & 0xFF);
+		lcdWriteData(y0 & 0xFF);
+		lcdWriteData((y1 >> 8) & 0xFF);
+		lcdWriteData(y1 & 0xFF);
+		lcdWindow.y0 = y0;
+		lcdWindow.y1 = y1;
+	}
+	lcdWindow.valid = true;
+	lcdWindow.px = x0;
+	lcdWindow.py = y0;
+	lcdWindow.ptrValid = false; // until the caller tells how many pixels it wrote.
 	lcdWriteCommand(ILI9341_MEMORYWRITE);
 }
 
+/**
+ * \brief Reports pixels written since the last lcdSetWindow()
+ *
+ * Lets the next lcdSetWindow() send a single WRITEMEMCONTINUE if it starts where
+ * the write pointer is. Either report every pixel written after lcdSetWindow() or
+ * none of them.
+ *
+ * \param nbpixels   Number of pixels written
+ *
+ * \return void
+ */
+void lcdAdvanceWritePointer(uint32_t nbpixels) {
+	if (!lcdWindow.valid)
+		return;
+	const uint32_t w = lcdWindow.x1 - lcdWindow.x0 + 1;
+	const uint32_t off = (lcdWindow.px - lcdWindow.x0) + nbpixels;
+	const uint32_t y = lcdWindow.py + off / w;
+	if (y > lcdWindow.y1) { // back at the start of the window.
+		lcdWindow.ptrValid = false;
+		return;
+	}
+	lcdWindow.px = lcdWindow.x0 + off % w;
+	lcdWindow.py = y;
+	lcdWindow.ptrValid = true;
+}
+
+/**
+ * \brief Forgets the cached address window
+ *
+ * Must be called after writing CASET/PASET without lcdSetWindow().
+ *
+ * \return void
+ */
+void lcdInvalidateWindow(void) {
+	lcdWindow.valid = false;
+	lcdWindow.ptrValid = false;
+}
+
 void lcdBacklightOff(void) {
 	LCD_BL_OFF();
 }
@@ -306,6 +377,42 @@ void lcdTearingOn(bool m) {
 	lcdWriteData(m);
 }
 
+/**
+ * \brief Defines the vertical scrolling area (along the 320 gate lines)
+ *
+ * \param tfa        Number of fixed lines at the top
+ * \param bfa        Number of fixed lines at the bottom
+ *
+ * \return void
+ */
+void lcdSetScrollArea(uint16_t tfa, uint16_t bfa) {
+	if (!lcdProperties.hwscrolling)
+		return;
+	uint16_t vsa = ILI9341_PHY_PIXEL_WIDTH - tfa - bfa;
+	lcdWriteCommand(ILI9341_VERTICALSCROLING);
+	lcdWriteData((tfa >> 8) & 0xFF);
+	lcdWriteData(tfa & 0xFF);
+	lcdWriteData((vsa >> 8) & 0xFF);
+	lcdWriteData(vsa & 0xFF);
+	lcdWriteData((bfa >> 8) & 0xFF);
+	lcdWriteData(bfa & 0xFF);
+}
+
+/**
+ * \brief Sets the memory line displayed first in the scrolling area
+ *
+ * \param line       Memory line (tfa <= line < tfa + vsa)
+ *
+ * \return void
+ */
+void lcdSetScrollStart(uint16_t line) {
+	if (!lcdProperties.hwscrolling)
+		return;
+	lcdWriteCommand(ILI9341_VSCROLLSTARTADDRESS);
+	lcdWriteData((line >> 8) & 0xFF);
+	lcdWriteData(line & 0xFF);
+}
+
 uint16_t lcdGetWidth(void) {
 	return lcdProperties.width;
 }
@@ -324,6 +431,15 @@ uint16_t lcdGetControllerID(void) {
 	return id;
 }
 
+uint16_t lcdGetScanline(void) {
+	uint16_t line;
+	lcdWriteCommand(ILI9341_GETSCANLINE);
+	line = lcdReadData(); // dummy read
+	line = ((uint16_t) (lcdReadData() & 0x03) << 8);
+	line |= (lcdReadData() & 0xFF);
+	return line;
+}
+
 lcdOrientationTypeDef lcdGetOrientation(void) {
 	return lcdProperties.orientation;
 }
@@ -351,6 +467,7 @@ uint16_t lcdReadPixel(uint16_t x, uint16_t y) {
 			|| (y >= lcdProperties.height))
 		return 0;
 
+	lcdInvalidateWindow();
 	lcdWriteCommand(ILI9341_COLADDRSET);
 	lcdWriteData((x >> 8) & 0xFF);
 	lcdWriteData(x & 0xFF);
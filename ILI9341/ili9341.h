@@ -16,6 +16,7 @@
 
 #define LCD_CmdWrite(command)	*(volatile uint16_t *) (LCD_BASE0) = (command)
 #define LCD_DataWrite(data)		*(volatile uint16_t *) (LCD_BASE1) = (data)
+#define LCD_DataWrite32(data)	*(volatile uint32_t *) (LCD_BASE1) = (data) // split by the FSMC in two 16 bit writes, low half first
 #define	LCD_StatusRead()		*(volatile uint16_t *) (LCD_BASE0) //if use read  Mcu interface DB0~DB15 needs increase pull high
 #define	LCD_DataRead()			*(volatile uint16_t *) (LCD_BASE1) //if use read  Mcu interface DB0~DB15 needs increase pull high
 
@@ -68,6 +69,8 @@ void lcdSetOrientation(lcdOrientationTypeDef orientation);
 void lcdSetCursor(unsigned short x, unsigned short y);
 void lcdSetWindow(unsigned short x0, unsigned short y0, unsigned short x1,
 		unsigned short y1);
+void lcdAdvanceWritePointer(uint32_t nbpixels);
+void lcdInvalidateWindow(void);
 void lcdBacklightOff(void);
 void lcdBacklightOn(void);
 void lcdInversionOff(void);
@@ -76,9 +79,12 @@ void lcdDisplayOff(void);
 void lcdDisplayOn(void);
 void lcdTearingOff(void);
 void lcdTearingOn(bool m);
+void lcdSetScrollArea(uint16_t tfa, uint16_t bfa);
+void lcdSetScrollStart(uint16_t line);
 uint16_t lcdGetWidth(void);
 uint16_t lcdGetHeight(void);
 uint16_t lcdGetControllerID(void);
+uint16_t lcdGetScanline(void);
 lcdOrientationTypeDef lcdGetOrientation(void);
 lcdPropertiesTypeDef lcdGetProperties(void);
 uint16_t lcdReadPixel(uint16_t x, uint16_t y);